@@ -9,10 +9,10 @@ BamReadGroup::BamReadGroup(const std::string& name) : reads(0), supp(0), unmap(0
 
   mapq = Histogram(0,100,1);
   nm = Histogram(0,100,1);
-  isize = Histogram(-2,2000,10);
+  isize = LogHistogram(-2);
   clip = Histogram(0,100,5);
   phred = Histogram(0,100,1);
-  len = Histogram(0,250,1);
+  len = LogHistogram(0);
 
 }
 
@@ -82,14 +82,22 @@ void BamReadGroup::addRead(SeqLib::BamRecord &r)
 
 }
 
-void BamStats::addRead(SeqLib::BamRecord &r)
+std::string BamStats::ReadGroup(const SeqLib::BamRecord &r)
 {
 
-  // get the read group
   std::string rg;
   r.GetZTag("RG", rg); 
   if (rg.empty()) // try grabbing from QNAME
     rg = "QNAMED_" + r.ParseReadGroup();
+  return rg;
+
+}
+
+void BamStats::addRead(SeqLib::BamRecord &r)
+{
+
+  // get the read group
+  std::string rg = ReadGroup(r);
 
 #ifdef DEBUG_STATS
   std::cout << "got read group tag " << rg << std::endl;
@@ -107,3 +115,68 @@ void BamStats::addRead(SeqLib::BamRecord &r)
       ff->second.addRead(r);
     }
 }
+
+void BamReadGroup::Save(std::ostream& out) const {
+
+  out << m_name << std::endl;
+  out << reads << " " << supp << " " << unmap << " " << qcfail << " " 
+      << duplicate << " " << mate_unmap << std::endl;
+  mapq.Save(out);
+  nm.Save(out);
+  isize.Save(out);
+  clip.Save(out);
+  phred.Save(out);
+  len.Save(out);
+
+}
+
+bool BamReadGroup::Load(std::istream& in) {
+
+  if (!(in >> reads >> supp >> unmap >> qcfail >> duplicate >> mate_unmap))
+    return false;
+
+  return mapq.Load(in) && nm.Load(in) && isize.Load(in) && 
+    clip.Load(in) && phred.Load(in) && len.Load(in);
+}
+
+void BamStats::Save(std::ostream& out) const {
+
+  out << m_group_map.size() << std::endl;
+  for (auto& i : m_group_map)
+    i.second.Save(out);
+
+}
+
+bool BamStats::Load(std::istream& in) {
+
+  m_group_map.clear();
+
+  size_t n = 0;
+  if (!(in >> n))
+    return false;
+
+  for (size_t i = 0; i < n; ++i) {
+    std::string rg;
+    in >> std::ws;
+    if (!std::getline(in, rg))
+      return false;
+    BamReadGroup g(rg);
+    if (!g.Load(in))
+      return false;
+    m_group_map[rg] = g;
+  }
+
+  return true;
+}
+
+size_t BamReadGroup::MemoryUsage() const {
+  return sizeof(BamReadGroup) + m_name.capacity() + mapq.MemoryUsage() + nm.MemoryUsage() + isize.MemoryUsage() + 
+    clip.MemoryUsage() + phred.MemoryUsage() + len.MemoryUsage();
+}
+
+size_t BamStats::MemoryUsage() const {
+  size_t b = 0;
+  for (const auto& i : m_group_map)
+    b += i.first.capacity() + i.second.MemoryUsage() + 2 * sizeof(void*); // plus the hash node
+  return b;
+}
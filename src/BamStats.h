@@ -6,6 +6,7 @@
 #include <iostream>
 
 #include "Histogram.h"
+#include "LogHistogram.h"
 #include "SeqLib/BamRecord.h"
 
 /** Small class to store a counter to measure BamWalker progress.
@@ -64,6 +65,15 @@ class BamReadGroup {
   /** Add a BamRecord to this read group */
   void addRead(SeqLib::BamRecord &r);
 
+  /** Write the counts and histograms, to be restored with Load */
+  void Save(std::ostream& out) const;
+
+  /** Restore counts and histograms written by Save */
+  bool Load(std::istream& in);
+
+  /** Return the bytes held by the counts and histograms */
+  size_t MemoryUsage() const;
+
  private:
 
   size_t reads;
@@ -75,10 +85,10 @@ class BamReadGroup {
 
   Histogram mapq;
   Histogram nm;
-  Histogram isize;
+  LogHistogram isize; // log-linear, since these can run to Mb for long reads
   Histogram clip;
   Histogram phred;
-  Histogram len;
+  LogHistogram len;
 
   std::string m_name;
 
@@ -103,6 +113,20 @@ class BamStats
    */
   void addRead(SeqLib::BamRecord &r);
 
+  /** Return the read group of a read: its RG tag, or else "QNAMED_" plus
+   * the read group parsed from its name */
+  static std::string ReadGroup(const SeqLib::BamRecord &r);
+
+  /** Write all of the read groups, to be restored with Load 
+   * (e.g. to resume a run from a checkpoint) */
+  void Save(std::ostream& out) const;
+
+  /** Replace the read groups with those written by Save */
+  bool Load(std::istream& in);
+
+  /** Return the bytes held by all of the read groups */
+  size_t MemoryUsage() const;
+
   std::unordered_map<std::string, BamReadGroup> m_group_map;
 
 };
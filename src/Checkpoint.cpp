@@ -0,0 +1,91 @@
+#include "Checkpoint.h"
+
+#include <fstream>
+#include <cstdio>
+#include <climits>
+
+void InputPosition::Update(const SeqLib::BamRecord& r) {
+
+  if (n && r.ChrID() == chr && (chr < 0 || r.Position() == pos)) {
+    ++n;
+    return;
+  }
+
+  chr = r.ChrID();
+  pos = chr < 0 ? -1 : r.Position();
+  n = 1;
+
+}
+
+bool InputPosition::Covers(const InputPosition& p) const {
+
+  // unmapped reads come at the end
+  int64_t c1 = chr < 0 ? INT_MAX : chr;
+  int64_t c2 = p.chr < 0 ? INT_MAX : p.chr;
+
+  if (c1 != c2)
+    return c2 < c1;
+  if (c1 != INT_MAX && pos != p.pos)
+    return p.pos < pos;
+  return p.n <= n;
+}
+
+SeqLib::GRC InputPosition::RemainingRegions(const SeqLib::BamHeader& h) const {
+
+  SeqLib::GRC grc;
+
+  if (chr >= 0) {
+    // pad back by one, in case of off-by-one in the region query. Reads
+    // starting before pos are skipped anyway
+    grc.add(SeqLib::GenomicRegion(chr, std::max(0, pos - 1), h.GetSequenceLength(chr)));
+    for (int i = chr + 1; i < h.NumSequences(); ++i)
+      grc.add(SeqLib::GenomicRegion(i, 0, h.GetSequenceLength(i)));
+  }
+
+  // unmapped reads with no position
+  grc.add(SeqLib::GenomicRegion(-2, 0, 0));
+
+  return grc;
+}
+
+bool Checkpoint::Write(const std::string& fn) const {
+
+  std::string tmp = fn + ".tmp";
+  {
+    std::ofstream out(tmp);
+    if (!out)
+      return false;
+
+    out << input << std::endl << output << std::endl
+	<< last.chr << " " << last.pos << " " << last.n << std::endl
+	<< replay.chr << " " << replay.pos << " " << replay.n << std::endl
+	<< flushed.chr << " " << flushed.pos << " " << flushed.n << std::endl
+	<< out_offset << " " << cov_a << " " << buffer_size << std::endl
+	<< rc.keep << " " << rc.total << std::endl;
+    stats.Save(out);
+
+    if (!out.good())
+      return false;
+  }
+
+  // replace the old checkpoint in one step
+  return std::rename(tmp.c_str(), fn.c_str()) == 0;
+}
+
+bool Checkpoint::Read(const std::string& fn) {
+
+  std::ifstream in(fn);
+  if (!in)
+    return false;
+
+  if (!std::getline(in, input) || !std::getline(in, output))
+    return false;
+
+  in >> last.chr >> last.pos >> last.n
+     >> replay.chr >> replay.pos >> replay.n
+     >> flushed.chr >> flushed.pos >> flushed.n
+     >> out_offset >> cov_a >> buffer_size
+     >> rc.keep >> rc.total;
+
+  return in.good() && stats.Load(in);
+}
@@ -0,0 +1,76 @@
+#ifndef VARIANT_CHECKPOINT_H__
+#define VARIANT_CHECKPOINT_H__
+
+#include <string>
+#include <cstdint>
+
+#include "SeqLib/BamRecord.h"
+#include "SeqLib/BamHeader.h"
+#include "SeqLib/GenomicRegionCollection.h"
+#include "BamStats.h"
+
+/** Position of a read in a coordinate-sorted file.
+ *
+ * A read is identified by its start position and by how many reads
+ * with that same start were seen before it (including itself). Unmapped reads
+ * at the end of the file all share chr -1, so n counts them all.
+ */
+struct InputPosition {
+
+  int32_t chr = -1;
+  int32_t pos = -1;
+  uint64_t n = 0; // number of reads seen at this start
+
+  /** Return true if this points at a read */
+  bool IsSet() const { return n > 0; }
+
+  /** Move to the next read */
+  void Update(const SeqLib::BamRecord& r);
+
+  /** Return true if the position p is at or before this one */
+  bool Covers(const InputPosition& p) const;
+
+  /** Make the regions to visit to get every read after this one.
+   * @param h Header of the input, for the sequence lengths
+   */
+  SeqLib::GRC RemainingRegions(const SeqLib::BamHeader& h) const;
+
+};
+
+/** State of a VariantBamWalker run, to resume from after an interruption.
+ *
+ * A checkpoint is only taken when every read up to "last" has been
+ * written and nothing is waiting in the -m buffer. The output is flushed
+ * to a BGZF block boundary first, so truncating the output to "out_offset"
+ * and resuming from "last" gives the same file as an uninterrupted run.
+ */
+struct Checkpoint {
+
+  std::string input;
+  std::string output;
+
+  InputPosition last; // last read whose output is complete
+
+  // last read before the current -m coverage window. Reads from here to
+  // "last" are replayed into the coverage, without being written again
+  InputPosition replay;
+
+  InputPosition flushed; // read at which the -m buffer was last written
+
+  int64_t out_offset = 0; // size of the output at the checkpoint
+
+  bool cov_a = true; // which coverage object is live
+  int32_t buffer_size = 10000;
+
+  ReadCount rc;
+  BamStats stats;
+
+  /** Write to a file. The file is replaced atomically */
+  bool Write(const std::string& fn) const;
+
+  /** Read from a file written by Write */
+  bool Read(const std::string& fn);
+
+};
+
+#endif
@@ -0,0 +1,135 @@
+#include "CoverageTrack.h"
+
+#include <climits>
+
+bool CoverageTrack::Open(const std::string& fn, const SeqLib::BamHeader& h) {
+
+  Close();
+
+  if (fn.size() > 3 && fn.compare(fn.size() - 3, 3, ".gz") == 0) {
+    m_bgzf = bgzf_open(fn.c_str(), "w");
+    m_open = m_bgzf != nullptr;
+  } else {
+    m_out.open(fn);
+    m_open = m_out.is_open();
+  }
+
+  m_hdr = h;
+  m_chr = -1;
+  return m_open;
+}
+
+void CoverageTrack::AddRead(const bam1_t* b) {
+
+  if (!m_open)
+    return;
+
+  const bam1_core_t& c = b->core;
+  if (c.tid < 0 || (c.flag & (BAM_FUNMAP | BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP)))
+    return;
+
+  // a read that goes backwards (e.g. a repeat from overlapping regions) is
+  // over a part that is already written, so is skipped
+  if (m_chr >= 0 && (c.tid < m_chr || (c.tid == m_chr && c.pos < m_pos)))
+    return;
+
+  if (c.tid != m_chr) {
+    finish();
+    m_chr = c.tid;
+    m_chr_name = m_hdr.IDtoName(m_chr);
+    m_pos = c.pos;
+    m_depth = 0;
+  }
+
+  advance(c.pos);
+
+  const uint32_t* cig = bam_get_cigar(b);
+  int32_t p = c.pos;
+  for (uint32_t i = 0; i < c.n_cigar; ++i) {
+    int op = bam_cigar_op(cig[i]);
+    int32_t len = bam_cigar_oplen(cig[i]);
+    if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
+      ++m_events[p];
+      --m_events[p + len];
+    }
+    if (bam_cigar_type(op) & 2)
+      p += len;
+  }
+
+}
+
+void CoverageTrack::advance(int32_t pos) {
+
+  while (!m_events.empty() && m_events.begin()->first < pos) {
+    auto it = m_events.begin();
+    emit(m_pos, it->first, m_depth);
+    m_pos = it->first;
+    m_depth += it->second;
+    m_events.erase(it);
+  }
+
+}
+
+void CoverageTrack::finish() {
+
+  advance(INT_MAX);
+  write_run();
+  m_run_start = m_run_end = m_run_depth = 0;
+  m_depth = 0;
+
+}
+
+void CoverageTrack::emit(int32_t start, int32_t end, int32_t depth) {
+
+  if (start >= end)
+    return;
+
+  if (depth == m_run_depth && start == m_run_end) {
+    m_run_end = end;
+    return;
+  }
+
+  write_run();
+  m_run_start = start;
+  m_run_end = end;
+  m_run_depth = depth;
+
+}
+
+void CoverageTrack::write_run() {
+
+  if (m_run_depth <= 0 || m_run_end <= m_run_start)
+    return;
+
+  m_line = m_chr_name;
+  m_line += '\t';
+  m_line += std::to_string(m_run_start);
+  m_line += '\t';
+  m_line += std::to_string(m_run_end);
+  m_line += '\t';
+  m_line += std::to_string(m_run_depth);
+  m_line += '\n';
+
+  if (m_bgzf)
+    bgzf_write(m_bgzf, m_line.data(), m_line.size());
+  else
+    m_out << m_line;
+
+}
+
+void CoverageTrack::Close() {
+
+  if (!m_open)
+    return;
+
+  finish();
+
+  if (m_bgzf) {
+    bgzf_close(m_bgzf);
+    m_bgzf = nullptr;
+  } else {
+    m_out.close();
+  }
+
+  m_open = false;
+}
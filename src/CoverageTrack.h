@@ -0,0 +1,89 @@
+#ifndef VARIANT_COVERAGE_TRACK_H__
+#define VARIANT_COVERAGE_TRACK_H__
+
+#include <map>
+#include <string>
+#include <fstream>
+#include <cstdint>
+
+#include "htslib/sam.h"
+#include "htslib/bgzf.h"
+#include "SeqLib/BamHeader.h"
+
+/** Write a bedGraph of read depth from a stream of reads sorted by position.
+ *
+ * Each aligned block (M, = or X) of a read adds a +1 event at its start and
+ * a -1 event at its end. No later read can change the depth before the start
+ * of the current read, so the runs up to there are written and their events
+ * dropped. Memory is bounded by the reads overlapping the current position.
+ * Unmapped, secondary, QC-fail and duplicate reads are not counted, and runs
+ * of zero depth are not written. Reads before the current contig or
+ * position are skipped, so the output is always a valid bedGraph. A name
+ * ending in .gz is BGZF compressed.
+ */
+class CoverageTrack {
+
+ public:
+
+  CoverageTrack() {}
+
+  ~CoverageTrack() { Close(); }
+
+  CoverageTrack(const CoverageTrack&) = delete;
+  CoverageTrack& operator=(const CoverageTrack&) = delete;
+
+  /** Open the track for writing
+   * @param fn File to write to
+   * @param h Header of the reads, to name the contigs
+   */
+  bool Open(const std::string& fn, const SeqLib::BamHeader& h);
+
+  bool IsOpen() const { return m_open; }
+
+  /** Add the depth of a read */
+  void AddRead(const bam1_t* b);
+
+  /** Write out what's left and close the file */
+  void Close();
+
+ private:
+
+  // write out the depth of everything before pos
+  void advance(int32_t pos);
+
+  // write out everything on the current contig
+  void finish();
+
+  // add [start, end) at depth to the run being built
+  void emit(int32_t start, int32_t end, int32_t depth);
+
+  void write_run();
+
+  bool m_open = false;
+
+  BGZF* m_bgzf = nullptr;
+
+  std::ofstream m_out;
+
+  SeqLib::BamHeader m_hdr;
+
+  int32_t m_chr = -1;
+
+  std::string m_chr_name;
+
+  // depth changes that are not written yet
+  std::map<int32_t, int32_t> m_events;
+
+  int32_t m_pos = 0; // everything before this is written
+  int32_t m_depth = 0; // depth at m_pos
+
+  // run of equal depth being built
+  int32_t m_run_start = 0;
+  int32_t m_run_end = 0;
+  int32_t m_run_depth = 0;
+
+  std::string m_line;
+
+};
+
+#endif
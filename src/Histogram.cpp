@@ -50,6 +50,28 @@ void Histogram::toCSV(std::ofstream &fs) {
     fs << i << std::endl;
 
 }
+void Histogram::Save(std::ostream &out) const {
+
+  out << m_bins.size();
+  for (auto& i : m_bins)
+    out << " " << i.m_count;
+  out << std::endl;
+
+}
+
+bool Histogram::Load(std::istream &in) {
+
+  size_t n = 0;
+  if (!(in >> n) || n != m_bins.size())
+    return false;
+
+  for (auto& i : m_bins)
+    if (!(in >> i.m_count))
+      return false;
+
+  return true;
+}
+
 void Histogram::removeElem(const int32_t& elem) {
   --m_bins[retrieveBinID(elem)];
 }
@@ -103,6 +103,11 @@ class Histogram {
 
   std::string toFileString() const;
 
+  /** Return the bytes held by the bins */
+  size_t MemoryUsage() const {
+    return m_bins.capacity() * sizeof(Bin) + m_ind.capacity() * sizeof(int32_t);
+  }
+
   friend std::ostream& operator<<(std::ostream &out, const Histogram &h) {
     for (auto& i : h.m_bins)
       out << i << std::endl;
@@ -135,6 +140,15 @@ class Histogram {
    */
   void toCSV(std::ofstream &fs);
 
+  /** Write the bin counts on one line, to be restored with Load
+   */
+  void Save(std::ostream &out) const;
+
+  /** Restore the bin counts written by Save. 
+   * @return false if the saved bins don't match this histogram
+   */
+  bool Load(std::istream &in);
+
   /** Return the total number of elements in the Histogram
    */
   int totalCount() const {
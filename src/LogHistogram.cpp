@@ -0,0 +1,77 @@
+#include "LogHistogram.h"
+
+#include <sstream>
+
+uint64_t LogHistogram::lower(size_t i) const {
+
+  if (i < (1u << m_bits))
+    return i;
+
+  size_t shift = (i >> m_bits) - 1;
+  return ((uint64_t)(1u << m_bits) + (i & ((1u << m_bits) - 1))) << shift;
+}
+
+uint64_t LogHistogram::width(size_t i) const {
+
+  if (i < (1u << m_bits))
+    return 1;
+
+  return 1ULL << ((i >> m_bits) - 1);
+}
+
+bool LogHistogram::Merge(const LogHistogram& h) {
+
+  if (h.m_min != m_min || h.m_bits != m_bits)
+    return false;
+
+  if (h.m_counts.size() > m_counts.size())
+    m_counts.resize(h.m_counts.size(), 0);
+  for (size_t i = 0; i < h.m_counts.size(); ++i)
+    m_counts[i] += h.m_counts[i];
+
+  return true;
+}
+
+uint64_t LogHistogram::totalCount() const {
+
+  uint64_t tot = 0;
+  for (auto& i : m_counts)
+    tot += i;
+  return tot;
+}
+
+std::string LogHistogram::toFileString() const {
+
+  std::stringstream ss;
+  for (size_t i = 0; i < m_counts.size(); ++i)
+    if (m_counts[i]) {
+      int64_t lo = (int64_t)lower(i) + m_min;
+      ss << (ss.tellp() > 0 ? "," : "") << lo << "_" << (lo + (int64_t)width(i) - 1) << "_" << m_counts[i];
+    }
+  return ss.str();
+}
+
+void LogHistogram::Save(std::ostream& out) const {
+
+  out << m_min << " " << m_bits << " " << m_counts.size();
+  for (auto& i : m_counts)
+    out << " " << i;
+  out << std::endl;
+
+}
+
+bool LogHistogram::Load(std::istream& in) {
+
+  int32_t min_value = 0;
+  int bits = 0;
+  size_t n = 0;
+  if (!(in >> min_value >> bits >> n) || min_value != m_min || bits != m_bits)
+    return false;
+
+  m_counts.assign(n, 0);
+  for (auto& i : m_counts)
+    if (!(in >> i))
+      return false;
+
+  return true;
+}
@@ -0,0 +1,82 @@
+#ifndef VBAM_LOG_HISTOGRAM_H__
+#define VBAM_LOG_HISTOGRAM_H__
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/** Histogram with log-linear bins, in the style of HdrHistogram.
+ *
+ * Values below 2^(bits+1) get a bin each. Above that, every power of two
+ * is split into 2^bits equal bins, so a bin is never wider than 1/2^bits of
+ * its lower bound (< 1% with the default of 7). Finding the bin is a few bit
+ * operations. Bins are only allocated up to the largest value seen, so even
+ * a 1 Mb read needs only ~1,800 counters. Histograms with the same min and
+ * bits have the same bins, so they can be merged by adding the counts.
+ */
+class LogHistogram {
+
+ public:
+
+  /** Construct an empty histogram
+   * @param min_value Smallest value to hold. Values below it are counted as it
+   * @param bits Precision, as the number of bins per power of two (log2)
+   */
+  LogHistogram(int32_t min_value = 0, int bits = 7) : m_min(min_value), m_bits(bits) {}
+
+  /** Add an element to the histogram */
+  void addElem(int32_t elem) {
+    size_t i = index(elem < m_min ? 0 : (uint32_t)((int64_t)elem - m_min));
+    if (i >= m_counts.size())
+      m_counts.resize(i + 1, 0);
+    ++m_counts[i];
+  }
+
+  /** Add the counts of another histogram with the same bins.
+   * @return false if the bins don't match
+   */
+  bool Merge(const LogHistogram& h);
+
+  /** Return the total number of elements in the histogram */
+  uint64_t totalCount() const;
+
+  /** Return the bytes held by the bins */
+  size_t MemoryUsage() const { return m_counts.capacity() * sizeof(uint64_t); }
+
+  /** Return the non-empty bins as "start_end_count,..." */
+  std::string toFileString() const;
+
+  /** Write the bin counts on one line, to be restored with Load */
+  void Save(std::ostream& out) const;
+
+  /** Restore the bin counts written by Save.
+   * @return false if the saved bins don't match this histogram
+   */
+  bool Load(std::istream& in);
+
+ private:
+
+  // bin of a value, relative to m_min
+  size_t index(uint32_t v) const {
+    if (!(v >> (m_bits + 1)))
+      return v;
+    int shift = (31 - __builtin_clz(v)) - m_bits;
+    return ((size_t)(shift + 1) << m_bits) + ((v >> shift) - (1u << m_bits));
+  }
+
+  // first value of a bin, relative to m_min
+  uint64_t lower(size_t i) const;
+
+  // width of a bin
+  uint64_t width(size_t i) const;
+
+  int32_t m_min;
+
+  int m_bits;
+
+  std::vector<uint64_t> m_counts;
+
+};
+
+#endif
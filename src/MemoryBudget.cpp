@@ -0,0 +1,45 @@
+#include "MemoryBudget.h"
+
+#include <algorithm>
+#include <cstdint>
+
+static const char* COMPONENT_NAMES[] = { "coverage", "-m buffer", "pairs", "fragment", "stats", "regions", "rules" };
+
+static const size_t MIN_AVAILABLE = 1 << 20;
+
+void MemoryBudget::Set(Component c, size_t bytes) {
+
+  m_bytes[c] = bytes;
+  m_peak[c] = std::max(m_peak[c], bytes);
+  m_peak_total = std::max(m_peak_total, Total());
+
+}
+
+size_t MemoryBudget::Total() const {
+
+  size_t t = 0;
+  for (size_t b : m_bytes)
+    t += b;
+  return t;
+}
+
+size_t MemoryBudget::Available(Component c) const {
+
+  if (!m_limit)
+    return SIZE_MAX;
+
+  size_t others = Total() - m_bytes[c];
+  return others + MIN_AVAILABLE < m_limit ? m_limit - others : MIN_AVAILABLE;
+}
+
+void MemoryBudget::Report(std::ostream& out) const {
+
+  out << "...peak memory:";
+  for (int i = 0; i < NUM_COMPONENTS; ++i)
+    out << (i ? ", " : " ") << COMPONENT_NAMES[i] << " " << (m_peak[i] >> 20) << " MB";
+  out << " (total " << (m_peak_total >> 20) << " MB";
+  if (m_limit)
+    out << " of " << (m_limit >> 20) << " MB budget";
+  out << ")" << std::endl;
+
+}
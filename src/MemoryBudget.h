@@ -0,0 +1,54 @@
+#ifndef VARIANT_MEMORY_BUDGET_H__
+#define VARIANT_MEMORY_BUDGET_H__
+
+#include <cstddef>
+#include <iostream>
+
+/** Account the memory of the big structures of a run against one budget.
+ *
+ * Each component reports its current size (an estimate from its element
+ * counts, not from the allocator). The walker reads the total to decide
+ * when to flush or spill, and the peaks are reported at the end of the run.
+ */
+class MemoryBudget {
+
+ public:
+
+  enum Component { COVERAGE, READ_BUFFER, PAIRS, FRAGMENT, STATS, REGIONS, RULES, NUM_COMPONENTS };
+
+  /** @param limit Bytes for all components together. 0 is no limit */
+  MemoryBudget(size_t limit = 0) : m_limit(limit) {}
+
+  void SetLimit(size_t limit) { m_limit = limit; }
+
+  size_t Limit() const { return m_limit; }
+
+  /** Set the current size of a component */
+  void Set(Component c, size_t bytes);
+
+  /** Current size of all components */
+  size_t Total() const;
+
+  /** True if the components are over the limit */
+  bool Over() const { return m_limit && Total() > m_limit; }
+
+  /** Bytes that component c can grow to, given the size of the others. At
+   * least 1 MB, so that it can still make progress */
+  size_t Available(Component c) const;
+
+  /** Write the peak size of each component on one line */
+  void Report(std::ostream& out) const;
+
+ private:
+
+  size_t m_limit;
+
+  size_t m_bytes[NUM_COMPONENTS] = {};
+
+  size_t m_peak[NUM_COMPONENTS] = {};
+
+  size_t m_peak_total = 0;
+
+};
+
+#endif
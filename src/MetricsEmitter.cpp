@@ -0,0 +1,221 @@
+#include "MetricsEmitter.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+
+// most seconds to wait for the reader to take the final record
+static const double STOP_TIMEOUT = 1;
+
+// seconds on the monotonic clock
+static double now_seconds() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// resident set size in bytes. Falls back to the peak RSS if /proc is not available
+static uint64_t resident_bytes() {
+
+  std::ifstream statm("/proc/self/statm");
+  uint64_t size = 0, resident = 0;
+  if (statm >> size >> resident)
+    return resident * sysconf(_SC_PAGESIZE);
+
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) != 0)
+    return 0;
+#ifdef __APPLE__
+  return ru.ru_maxrss; // bytes on OSX
+#else
+  return ru.ru_maxrss * 1024; // kilobytes on Linux
+#endif
+}
+
+// escape a contig name for a JSON string
+static std::string json_escape(const std::string& s) {
+  std::string out;
+  for (char c : s) {
+    if (c == '"' || c == '\\')
+      out += '\\';
+    out += c;
+  }
+  return out;
+}
+
+void MetricsEmitter::Start(const std::string& dest, const RunMetrics* m, const SeqLib::BamHeader& h, double interval) {
+
+  if (m_thread.joinable())
+    return;
+
+  m_dest = dest;
+  m_metrics = m;
+  m_hdr = h;
+  m_interval = interval > 0 ? interval : 10;
+  m_stop = false;
+  m_start_time = m_last_time = now_seconds();
+  m_last_reads = 0;
+
+  m_thread = std::thread(&MetricsEmitter::run, this);
+
+}
+
+void MetricsEmitter::Stop() {
+
+  if (!m_thread.joinable())
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_cv.notify_all();
+  m_thread.join();
+
+}
+
+bool MetricsEmitter::open_dest() {
+
+  if (m_dest.compare(0, 5, "unix:") == 0) {
+
+    std::string path = m_dest.substr(5);
+    struct sockaddr_un addr;
+    if (path.size() >= sizeof(addr.sun_path))
+      return false;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    m_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_fd < 0)
+      return false;
+    if (connect(m_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+      int err = errno;
+      close(m_fd);
+      m_fd = -1;
+      errno = err;
+      return false;
+    }
+    m_socket = true;
+    fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) | O_NONBLOCK);
+    return true;
+  }
+
+  // file or FIFO. A FIFO with no reader fails with ENXIO rather than blocking.
+  // It stays non-blocking, so a full FIFO can be given up on
+  m_fd = open(m_dest.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK, 0644);
+  return m_fd >= 0;
+}
+
+std::string MetricsEmitter::format_record(bool done) {
+
+  double t = now_seconds();
+  uint64_t reads = m_metrics->reads.load(std::memory_order_relaxed);
+  uint64_t kept = m_metrics->kept.load(std::memory_order_relaxed);
+  int32_t chr = m_metrics->chr.load(std::memory_order_relaxed);
+
+  std::string chrname = "*";
+  if (chr >= 0 && chr < m_hdr.NumSequences())
+    chrname = m_hdr.IDtoName(chr);
+
+  double dt = t - m_last_time;
+  double rate = dt > 0 ? (reads - m_last_reads) / dt : 0;
+  m_last_time = t;
+  m_last_reads = reads;
+
+  std::stringstream ss;
+  ss << "{\"elapsed\":" << (t - m_start_time)
+     << ",\"reads\":" << reads
+     << ",\"kept\":" << kept
+     << ",\"kept_pct\":" << (reads ? 100.0 * kept / reads : 0)
+     << ",\"reads_per_sec\":" << rate
+     << ",\"chr\":\"" << json_escape(chrname) << "\""
+     << ",\"pos\":" << m_metrics->pos.load(std::memory_order_relaxed)
+     << ",\"bytes_in\":" << m_metrics->bytes_in.load(std::memory_order_relaxed)
+     << ",\"bytes_out\":" << m_metrics->bytes_out.load(std::memory_order_relaxed)
+     << ",\"buffered_reads\":" << m_metrics->buffered.load(std::memory_order_relaxed)
+     << ",\"eval_jobs_queued\":" << m_metrics->eval_jobs.load(std::memory_order_relaxed)
+     << ",\"rss\":" << resident_bytes()
+     << ",\"done\":" << (done ? "true" : "false")
+     << "}\n";
+
+  return ss.str();
+}
+
+bool MetricsEmitter::write_record(const std::string& line, double timeout) {
+
+  const char* p = line.c_str();
+  size_t left = line.size();
+  double deadline = now_seconds() + timeout;
+  while (left) {
+    ssize_t n = m_socket ? send(m_fd, p, left, MSG_NOSIGNAL) : write(m_fd, p, left);
+    if (n > 0) {
+      p += n;
+      left -= n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+      return false;
+
+    // the reader is behind. Wait for room, up to the deadline
+    double wait = deadline - now_seconds();
+    struct pollfd pfd = { m_fd, POLLOUT, 0 };
+    if (wait <= 0 || poll(&pfd, 1, (int)(wait * 1000) + 1) <= 0)
+      return false;
+  }
+
+  return true;
+}
+
+void MetricsEmitter::run() {
+
+  // a closed FIFO should end the metrics, not the run
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  // a FIFO or socket may not have a reader yet, so keep trying
+  while (!open_dest()) {
+    int err = errno;
+    bool is_socket = m_dest.compare(0, 5, "unix:") == 0;
+    if (err != ENXIO && !(is_socket && (err == ECONNREFUSED || err == ENOENT))) {
+      std::cerr << "WARNING: could not open metrics destination " << m_dest << ": " << std::strerror(err) << std::endl;
+      return;
+    }
+    if (m_cv.wait_for(lock, std::chrono::duration<double>(m_interval), [this]{ return m_stop; }))
+      return;
+  }
+
+  // write without the lock, so that Stop never waits on the reader
+  bool ok = true;
+  while (ok) {
+    m_cv.wait_for(lock, std::chrono::duration<double>(m_interval), [this]{ return m_stop; });
+    bool done = m_stop;
+    std::string line = format_record(done);
+    lock.unlock();
+    ok = write_record(line, done ? STOP_TIMEOUT : m_interval);
+    lock.lock();
+    if (done)
+      break;
+  }
+
+  close(m_fd);
+  m_fd = -1;
+
+}
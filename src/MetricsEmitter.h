@@ -0,0 +1,103 @@
+#ifndef VARIANT_METRICS_EMITTER_H__
+#define VARIANT_METRICS_EMITTER_H__
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <cstdint>
+
+#include "SeqLib/BamHeader.h"
+
+/** Live counters of a run, updated by the walker.
+ *
+ * Only relaxed atomic stores happen on the filtering thread. The
+ * MetricsEmitter reads them from its own thread.
+ */
+struct RunMetrics {
+
+  std::atomic<uint64_t> reads{0};
+  std::atomic<uint64_t> kept{0};
+
+  std::atomic<int32_t> chr{-1}; // position of the last read
+  std::atomic<int32_t> pos{-1};
+
+  std::atomic<uint64_t> bytes_in{0}; // BAM record bytes (uncompressed)
+  std::atomic<uint64_t> bytes_out{0};
+
+  std::atomic<uint64_t> buffered{0}; // reads waiting in the -m buffer
+  std::atomic<uint64_t> eval_jobs{0}; // rule jobs on the pool queue, when the last batch was handed out
+
+};
+
+/** Write RunMetrics as JSON lines at a fixed interval.
+ *
+ * The destination is a file or FIFO (appended to), or a Unix socket
+ * given as "unix:/path/to/socket". The destination is opened on the emitter
+ * thread, so a FIFO with no reader yet doesn't hold up the run. Records
+ * are written without blocking, and outside the lock that Stop takes, so a
+ * stalled reader can't hang the end of the run. If the reader goes away, or
+ * can't take a record in time, the emitter stops quietly.
+ */
+class MetricsEmitter {
+
+ public:
+
+  MetricsEmitter() {}
+
+  ~MetricsEmitter() { Stop(); }
+
+  /** Start emitting on a background thread
+   * @param dest File, FIFO or unix:<socket path> to write to
+   * @param m Counters to report. Must outlive the emitter
+   * @param h Header of the input, to name the current contig
+   * @param interval Seconds between records
+   */
+  void Start(const std::string& dest, const RunMetrics* m, const SeqLib::BamHeader& h, double interval);
+
+  /** Write a final record (with "done" : true) and stop the thread */
+  void Stop();
+
+ private:
+
+  void run();
+
+  bool open_dest();
+
+  // the next JSON record
+  std::string format_record(bool done);
+
+  // write a record, waiting at most timeout seconds for the reader
+  bool write_record(const std::string& line, double timeout);
+
+  std::string m_dest;
+
+  const RunMetrics* m_metrics = nullptr;
+
+  SeqLib::BamHeader m_hdr;
+
+  double m_interval = 10;
+
+  int m_fd = -1;
+
+  bool m_socket = false;
+
+  std::thread m_thread;
+
+  std::mutex m_mutex;
+
+  std::condition_variable m_cv;
+
+  bool m_stop = false;
+
+  // for the rate since the last record
+  uint64_t m_last_reads = 0;
+
+  double m_last_time = 0;
+
+  double m_start_time = 0;
+
+};
+
+#endif
@@ -0,0 +1,267 @@
+#include "OutputWriter.h"
+
+#include <algorithm>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "htslib/bgzf.h"
+#include "htslib/hfile.h"
+
+#include "SeqLib/SeqLibCommon.h"
+
+// complement of each base code of seq_nt16_str
+static const char NT16_COMPLEMENT[] = "=TGKCYSBAWRDMHVN";
+
+// quality to write for reads stored without one (Phred 1, as samtools fastq)
+static const char MISSING_QUAL = '"';
+
+// close the htsFile when the last copy of the writer goes away,
+// saving or building the index first if one was requested
+struct htsFileCloser {
+
+  bool index = false; // index is being built on the fly
+  bool index_after = false; // index is built from the file once closed
+  int min_shift = 0;
+  std::string fn;
+
+  void operator()(htsFile* f) const {
+#if defined(HTS_VERSION) && HTS_VERSION >= 101000
+    if (index && sam_idx_save(f) < 0)
+      std::cerr << "ERROR: failed to save index for " << fn << std::endl;
+#endif
+    sam_close(f);
+    if (index_after && sam_index_build(fn.c_str(), min_shift) < 0)
+      std::cerr << "ERROR: failed to build index for " << fn << std::endl;
+  }
+};
+
+OutputWriter::OutputWriter(int o) {
+
+  switch(o) {
+  case SeqLib::BAM :  m_mode = "wb"; break;
+  case SeqLib::CRAM : m_mode = "wc"; break;
+  case SeqLib::SAM :  m_mode = "w";  break;
+  default:
+    std::cerr << "Invalid output format for OutputWriter. Defaulting to BAM" << std::endl;
+    m_mode = "wb";
+  }
+
+}
+
+OutputWriter::OutputWriter(FastqMode m, bool compress) : m_fastq(m) {
+
+  m_mode = compress ? "wz" : "w";
+
+}
+
+bool OutputWriter::Open(const std::string& f) {
+
+  // don't reopen
+  if (fop)
+    return false;
+
+  m_out = f;
+
+  htsFile* fp = sam_open(m_out.c_str(), m_mode.c_str());
+  if (!fp)
+    return false;
+
+  htsFileCloser closer;
+  closer.fn = m_out;
+  fop = std::shared_ptr<htsFile>(fp, closer);
+
+  return true;
+}
+
+bool OutputWriter::OpenR2(const std::string& f) {
+
+  if (!fop || fop2 || m_fastq != FASTQ_PAIRED)
+    return false;
+
+  htsFile* fp = sam_open(f.c_str(), m_mode.c_str());
+  if (!fp)
+    return false;
+
+  htsFileCloser closer;
+  closer.fn = f;
+  fop2 = std::shared_ptr<htsFile>(fp, closer);
+
+  if (m_pool.IsOpen())
+    return hts_set_opt(fp, HTS_OPT_THREAD_POOL, m_pool.tp.get()) == 0;
+
+  return true;
+}
+
+bool OutputWriter::OpenAppend(const std::string& f, int64_t offset) {
+
+  if (fop || f == "-" || m_mode == "w")
+    return false;
+
+  // drop anything written after the offset (including any EOF block)
+  if (truncate(f.c_str(), offset) != 0)
+    return false;
+
+  std::string mode = m_mode;
+  mode[0] = 'a';
+
+  m_out = f;
+  htsFile* fp = sam_open(m_out.c_str(), mode.c_str());
+  if (!fp)
+    return false;
+
+  htsFileCloser closer;
+  closer.fn = m_out;
+  fop = std::shared_ptr<htsFile>(fp, closer);
+
+  return true;
+}
+
+int64_t OutputWriter::Flush() {
+
+  if (!fop || !fop->is_bgzf)
+    return -1;
+
+  BGZF* fp = fop->fp.bgzf;
+  if (bgzf_flush(fp) < 0 || hflush(fp->fp) < 0)
+    return -1;
+
+  // make sure the flushed blocks survive a crash of the machine
+  int fd = open(m_out.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+
+  return bgzf_tell(fp) >> 16;
+}
+
+void OutputWriter::SetHeader(const SeqLib::BamHeader& h) {
+  hdr = h;
+}
+
+bool OutputWriter::WriteHeader() const {
+
+  // FASTQ has no header
+  if (IsFastq())
+    return fop.get() != NULL;
+
+  if (!fop || hdr.isEmpty()) {
+    std::cerr << "OutputWriter::WriteHeader - output not open or header not set" << std::endl;
+    return false;
+  }
+
+  if (sam_hdr_write(fop.get(), hdr.get()) < 0) {
+    std::cerr << "Cannot write header to " << m_out << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+bool OutputWriter::SetCramReference(const std::string& ref) {
+
+  if (!fop)
+    return false;
+
+  // for CRAM, this sets the reference fasta
+  return hts_set_fai_filename(fop.get(), ref.c_str()) >= 0;
+}
+
+bool OutputWriter::SetThreadPool(SeqLib::ThreadPool& p) {
+
+  if (!p.IsOpen() || !fop)
+    return false;
+
+  if (fop2 && hts_set_opt(fop2.get(), HTS_OPT_THREAD_POOL, p.tp.get()) != 0)
+    return false;
+
+  m_pool = p;
+  return hts_set_opt(fop.get(), HTS_OPT_THREAD_POOL, p.tp.get()) == 0;
+}
+
+bool OutputWriter::SetBuildIndex(int min_shift) {
+
+  if (!fop || m_out == "-" || m_mode == "w" || IsFastq()) {
+    std::cerr << "ERROR: can only index BAM or CRAM written to a file" << std::endl;
+    return false;
+  }
+
+  htsFileCloser* closer = std::get_deleter<htsFileCloser>(fop);
+  closer->min_shift = min_shift;
+
+#if defined(HTS_VERSION) && HTS_VERSION >= 101000
+  std::string idx = m_out + (m_mode == "wc" ? ".crai" : min_shift > 0 ? ".csi" : ".bai");
+  if (sam_idx_init(fop.get(), hdr.get(), min_shift, idx.c_str()) < 0) {
+    std::cerr << "ERROR: could not start index " << idx << std::endl;
+    return false;
+  }
+  closer->index = true;
+#else
+  // htslib too old to index while writing, so index the finished file
+  closer->index_after = true;
+#endif
+
+  return true;
+}
+
+bool OutputWriter::WriteRecord(const SeqLib::BamRecord& r, int32_t start, int32_t end) {
+
+  if (!fop)
+    return false;
+
+  if (!IsFastq())
+    return sam_write1(fop.get(), hdr.get(), r.raw()) >= 0;
+
+  // each read once, as samtools fastq does
+  const bam1_t* b = r.raw();
+  if (b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY))
+    return true;
+
+  m_fastq_buf.clear();
+  format_fastq(b, std::max(start, 0), std::min(end, b->core.l_qseq));
+
+  htsFile* f = fop2 && (b->core.flag & BAM_FREAD2) ? fop2.get() : fop.get();
+  ssize_t n = f->is_bgzf ? bgzf_write(f->fp.bgzf, m_fastq_buf.data(), m_fastq_buf.size()) :
+    hwrite(f->fp.hfile, m_fastq_buf.data(), m_fastq_buf.size());
+  return n == static_cast<ssize_t>(m_fastq_buf.size());
+}
+
+void OutputWriter::format_fastq(const bam1_t* b, int32_t start, int32_t end) {
+
+  const uint16_t flag = b->core.flag;
+  std::string& s = m_fastq_buf;
+
+  s += '@';
+  s += bam_get_qname(b);
+  if (m_fastq == FASTQ_PAIRED && (flag & BAM_FPAIRED) && (flag & (BAM_FREAD1 | BAM_FREAD2)))
+    s += flag & BAM_FREAD1 ? "/1" : "/2";
+  s += '\n';
+
+  // reverse strand reads are stored reverse complemented, so undo it
+  const bool rev = flag & BAM_FREVERSE;
+  const int32_t len = std::max(end - start, 0);
+  const uint8_t* seq = bam_get_seq(b);
+  for (int32_t i = 0; i < len; ++i) {
+    int c = bam_seqi(seq, rev ? end - 1 - i : start + i);
+    s += rev ? NT16_COMPLEMENT[c] : seq_nt16_str[c];
+  }
+  s += "\n+\n";
+
+  const uint8_t* qual = bam_get_qual(b);
+  const bool has_qual = b->core.l_qseq && qual[0] != 0xff;
+  for (int32_t i = 0; i < len; ++i)
+    s += has_qual ? static_cast<char>(qual[rev ? end - 1 - i : start + i] + 33) : MISSING_QUAL;
+  s += '\n';
+
+}
+
+bool OutputWriter::Close() {
+
+  if (!fop)
+    return false;
+
+  fop.reset(); // closer saves the index and closes the file
+  fop2.reset();
+  return true;
+}
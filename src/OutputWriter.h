@@ -0,0 +1,127 @@
+#ifndef VARIANT_OUTPUT_WRITER_H__
+#define VARIANT_OUTPUT_WRITER_H__
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "htslib/sam.h"
+#include "SeqLib/BamRecord.h"
+#include "SeqLib/BamHeader.h"
+#include "SeqLib/ThreadPool.h"
+
+/** Write BAM/SAM/CRAM records, optionally building the index as we go.
+ *
+ * Follows the SeqLib::BamWriter interface, but keeps hold of the
+ * htsFile so that the .bai/.csi/.crai can be built on the fly from
+ * the records as they are written (htslib >= 1.10). With an older htslib,
+ * the index is built from the finished file when it is closed.
+ *
+ * Can also write the reads as FASTQ, back in the orientation they were
+ * sequenced in, BGZF compressed on the thread pool if asked.
+ */
+class OutputWriter {
+
+ public:
+
+  /** How FASTQ output names the reads of a pair */
+  enum FastqMode { FASTQ_OFF, FASTQ_SINGLE, FASTQ_PAIRED };
+
+  /** Construct an empty writer for BAM output */
+  OutputWriter() : m_mode("wb") {}
+
+  /** Construct an empty writer
+   * @param o Output format (SeqLib::BAM, SeqLib::SAM or SeqLib::CRAM)
+   */
+  OutputWriter(int o);
+
+  /** Construct an empty writer for FASTQ output
+   * @param m FASTQ_SINGLE writes names as they are. FASTQ_PAIRED adds /1 and /2
+   * to the names of paired reads, which are interleaved unless OpenR2 is called
+   * @param compress Write BGZF (gzip compatible) instead of plain text
+   */
+  OutputWriter(FastqMode m, bool compress);
+
+  /** Open the file for writing. "-" is stdout */
+  bool Open(const std::string& f);
+
+  /** Open a second file for FASTQ_PAIRED, to write the second reads of pairs to */
+  bool OpenR2(const std::string& f);
+
+  /** Set the header to write with WriteHeader */
+  void SetHeader(const SeqLib::BamHeader& h);
+
+  /** Write the header. Must be called before writing records */
+  bool WriteHeader() const;
+
+  /** Set the reference fasta for CRAM output */
+  bool SetCramReference(const std::string& ref);
+
+  /** Use a shared thread pool for compression */
+  bool SetThreadPool(SeqLib::ThreadPool& p);
+
+  /** Build the index while writing. Call after WriteHeader and before any records.
+   * @param min_shift 0 for .bai (or .crai for CRAM), 14 for .csi
+   */
+  bool SetBuildIndex(int min_shift);
+
+  /** Write a record. Returns false on failure (e.g. unsorted records when indexing)
+   * @param start For FASTQ output, the first base to write
+   * @param end For FASTQ output, one past the last base to write. Other formats
+   * always write the whole record
+   */
+  bool WriteRecord(const SeqLib::BamRecord& r, int32_t start = 0, int32_t end = INT32_MAX);
+
+  /** Flush the BGZF output to a block boundary, and sync it to disk.
+   * @return The size of the file after the flush, or -1 if not BGZF output
+   */
+  int64_t Flush();
+
+  /** Open an existing BGZF file for appending, after truncating it.
+   * The header is not written again.
+   * @param f File to append to
+   * @param offset Size to truncate the file to, from a previous Flush
+   */
+  bool OpenAppend(const std::string& f, int64_t offset);
+
+  /** Close the file, saving the index if one is being built */
+  bool Close();
+
+  /** Return true if the writer has been opened */
+  bool IsOpen() const { return fop.get() != NULL; }
+
+  /** Return the output header */
+  const SeqLib::BamHeader& Header() const { return hdr; }
+
+  /** Return the name of the output file */
+  const std::string& FileName() const { return m_out; }
+
+  /** Return true if writing FASTQ */
+  bool IsFastq() const { return m_fastq != FASTQ_OFF; }
+
+ private:
+
+  // append one FASTQ record to m_fastq_buf
+  void format_fastq(const bam1_t* b, int32_t start, int32_t end);
+
+  std::shared_ptr<htsFile> fop;
+
+  // second reads, for split FASTQ
+  std::shared_ptr<htsFile> fop2;
+
+  FastqMode m_fastq = FASTQ_OFF;
+
+  // set on fop2 too, if it is opened after SetThreadPool
+  SeqLib::ThreadPool m_pool;
+
+  std::string m_fastq_buf;
+
+  SeqLib::BamHeader hdr;
+
+  std::string m_out;
+
+  std::string m_mode;
+
+};
+
+#endif
@@ -0,0 +1,215 @@
+#include "PairLinker.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "VariantBamError.h"
+
+// spilled runs to keep open. One more merges them all into one
+static const size_t MAX_RUNS = 16;
+
+// least budget, so that a tight memory limit doesn't spill every few reads
+const size_t PairLinker::MIN_BUDGET = 16ULL << 20;
+
+// rough memory held by a waiting read: the record, its data, and the table entry
+static size_t read_bytes(const SeqLib::BamRecord& r) {
+  return sizeof(bam1_t) + r.raw()->m_data + r.raw()->core.l_qname + 64;
+}
+
+PairLinker::~PairLinker() {
+  for (auto& f : m_runs)
+    fclose(f);
+}
+
+bool PairLinker::Add(const SeqLib::BamRecord& r, bool pass, uint64_t routes, PendingRead& mate) {
+
+  std::string qname(bam_get_qname(r.raw()));
+
+  auto ff = m_table.find(qname);
+  if (ff != m_table.end()) {
+    mate = ff->second;
+    m_bytes -= std::min(m_bytes, read_bytes(mate.r));
+    m_table.erase(ff);
+    return true;
+  }
+
+  PendingRead& p = m_table[qname];
+  p.r = r;
+  p.pass = pass;
+  p.routes = routes;
+  m_bytes += read_bytes(r);
+
+  if (m_bytes > m_budget)
+    spill();
+
+  return false;
+}
+
+std::vector<PendingRead> PairLinker::drain() {
+
+  std::vector<PendingRead> v;
+  v.reserve(m_table.size());
+  for (auto& i : m_table)
+    v.push_back(i.second);
+
+  std::sort(v.begin(), v.end(), [](const PendingRead& a, const PendingRead& b) {
+      return strcmp(bam_get_qname(a.r.raw()), bam_get_qname(b.r.raw())) < 0;
+    });
+
+  m_table.clear();
+  m_bytes = 0;
+  return v;
+}
+
+// an unlinked temporary file, so it goes away however the run ends
+static FILE* temp_file(std::string& name) {
+
+  const char* dir = getenv("TMPDIR");
+  name = std::string(dir && *dir ? dir : "/tmp") + "/variant_pairs_XXXXXX";
+  int fd = mkstemp(&name[0]);
+  FILE* fp = fd < 0 ? nullptr : fdopen(fd, "w+b");
+  if (!fp)
+    throw VariantBamError("could not create temporary file " + name + " to spill read pairs");
+  unlink(name.c_str());
+  return fp;
+}
+
+void PairLinker::spill() {
+
+  std::string name;
+  FILE* fp = temp_file(name);
+  for (const auto& p : drain())
+    if (!write_read(fp, p))
+      throw VariantBamError("failed writing read pairs to temporary file. Is " + name + " full?");
+
+  m_runs.push_back(fp);
+  ++m_spills;
+  if (m_runs.size() > MAX_RUNS)
+    merge_runs();
+}
+
+bool PairLinker::head_after(const Run* a, const Run* b) {
+  return strcmp(bam_get_qname(a->head.r.raw()), bam_get_qname(b->head.r.raw())) > 0;
+}
+
+void PairLinker::merge_runs() {
+
+  std::vector<Run> runs(m_runs.size());
+  std::vector<Run*> heap;
+  for (size_t i = 0; i < m_runs.size(); ++i) {
+    rewind(m_runs[i]);
+    runs[i].fp = m_runs[i];
+    if (runs[i].advance())
+      heap.push_back(&runs[i]);
+  }
+  std::make_heap(heap.begin(), heap.end(), head_after);
+
+  std::string name;
+  FILE* out = temp_file(name);
+  while (!heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), head_after);
+    Run* r = heap.back();
+    if (!write_read(out, r->head))
+      throw VariantBamError("failed writing read pairs to temporary file. Is " + name + " full?");
+    if (r->advance())
+      std::push_heap(heap.begin(), heap.end(), head_after);
+    else
+      heap.pop_back();
+  }
+
+  for (auto& f : m_runs)
+    fclose(f);
+  m_runs.assign(1, out);
+}
+
+bool PairLinker::write_read(FILE* fp, const PendingRead& p) {
+
+  const bam1_t* b = p.r.raw();
+  uint8_t pass = p.pass;
+  uint32_t l_data = b->l_data;
+  return fwrite(&pass, 1, 1, fp) == 1 &&
+    fwrite(&p.routes, sizeof(p.routes), 1, fp) == 1 &&
+    fwrite(&b->core, sizeof(b->core), 1, fp) == 1 &&
+    fwrite(&l_data, sizeof(l_data), 1, fp) == 1 &&
+    fwrite(b->data, 1, l_data, fp) == l_data;
+}
+
+bool PairLinker::read_read(FILE* fp, PendingRead& p) {
+
+  uint8_t pass = 0;
+  uint32_t l_data = 0;
+  bam1_t* b = bam_init1();
+  if (fread(&pass, 1, 1, fp) != 1 ||
+      fread(&p.routes, sizeof(p.routes), 1, fp) != 1 ||
+      fread(&b->core, sizeof(b->core), 1, fp) != 1 ||
+      fread(&l_data, sizeof(l_data), 1, fp) != 1) {
+    bam_destroy1(b);
+    return false;
+  }
+
+  b->data = (uint8_t*)malloc(l_data);
+  b->m_data = l_data;
+  b->l_data = l_data;
+  if (!b->data || fread(b->data, 1, l_data, fp) != l_data) {
+    bam_destroy1(b);
+    throw VariantBamError("temporary file of read pairs is truncated");
+  }
+
+  p.pass = pass;
+  p.r = SeqLib::BamRecord();
+  p.r.assign(b);
+  return true;
+}
+
+bool PairLinker::Run::advance() {
+
+  if (fp)
+    has_head = read_read(fp, head);
+  else if ((has_head = next < reads.size()))
+    head = reads[next++];
+
+  return has_head;
+}
+
+bool PairLinker::NextGroup(std::vector<PendingRead>& group) {
+
+  group.clear();
+
+  if (!m_merging) {
+    m_merging = true;
+    for (auto& f : m_runs) {
+      rewind(f);
+      m_merge.push_back(Run());
+      m_merge.back().fp = f;
+    }
+    m_merge.push_back(Run());
+    m_merge.back().reads = drain();
+    for (auto& r : m_merge)
+      if (r.advance())
+	m_heap.push_back(&r);
+    std::make_heap(m_heap.begin(), m_heap.end(), head_after);
+  }
+
+  if (m_heap.empty())
+    return false;
+
+  // take the reads with the smallest QNAME from the top runs
+  std::string name(bam_get_qname(m_heap.front()->head.r.raw()));
+  while (!m_heap.empty() && name == bam_get_qname(m_heap.front()->head.r.raw())) {
+    std::pop_heap(m_heap.begin(), m_heap.end(), head_after);
+    Run* r = m_heap.back();
+    while (r->has_head && name == bam_get_qname(r->head.r.raw())) {
+      group.push_back(r->head);
+      r->advance();
+    }
+    if (r->has_head)
+      std::push_heap(m_heap.begin(), m_heap.end(), head_after);
+    else
+      m_heap.pop_back();
+  }
+
+  return true;
+}
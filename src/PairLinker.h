@@ -0,0 +1,112 @@
+#ifndef VARIANT_PAIR_LINKER_H__
+#define VARIANT_PAIR_LINKER_H__
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "SeqLib/BamRecord.h"
+
+/** A read waiting for its mate, with the result of its rules */
+struct PendingRead {
+
+  SeqLib::BamRecord r;
+
+  uint64_t routes = 0; // output routes that passed, for multi-output runs
+
+  bool pass = false;
+
+};
+
+/** Match up the mates of read pairs from coordinate-sorted input.
+ *
+ * The first mate of a pair waits in a table keyed by QNAME until the
+ * second one arrives. If the table grows past its memory budget, it is
+ * written to a temporary file sorted by QNAME and cleared. Past a few
+ * such runs, they are merged into one, so the open files stay few. After
+ * the input ends, NextGroup merges the table with the spilled runs, so
+ * that mates which were split across them come out together.
+ */
+class PairLinker {
+
+ public:
+
+  /** @param budget Bytes of reads to hold in memory before spilling */
+  PairLinker(size_t budget = 512ULL << 20) { SetBudget(budget); }
+
+  ~PairLinker();
+
+  PairLinker(const PairLinker&) = delete;
+  PairLinker& operator=(const PairLinker&) = delete;
+
+  /** Least budget. A smaller one is raised to it */
+  static const size_t MIN_BUDGET;
+
+  void SetBudget(size_t budget) { m_budget = std::max(budget, MIN_BUDGET); }
+
+  size_t Budget() const { return m_budget; }
+
+  /** Bytes of reads waiting in memory */
+  size_t MemoryUsage() const { return m_bytes; }
+
+  /** Add a read. If its mate is waiting in memory, the mate is taken
+   * out of the table and returned.
+   * @return true if mate was filled
+   */
+  bool Add(const SeqLib::BamRecord& r, bool pass, uint64_t routes, PendingRead& mate);
+
+  /** After the last Add, return the next group of reads with the same
+   * QNAME (a pair, or a read whose mate never came).
+   * @return false when there are no more
+   */
+  bool NextGroup(std::vector<PendingRead>& group);
+
+  /** Number of times the table was spilled to disk */
+  size_t NumSpills() const { return m_spills; }
+
+ private:
+
+  // one sorted run of reads, in memory or on disk
+  struct Run {
+    FILE* fp = nullptr; // spilled run, or NULL for the in-memory one
+    std::vector<PendingRead> reads; // in-memory run
+    size_t next = 0;
+    PendingRead head; // next read of the run
+    bool has_head = false;
+    bool advance();
+  };
+
+  void spill();
+
+  // merge the spilled runs into one
+  void merge_runs();
+
+  // heap order of runs, smallest head QNAME on top
+  static bool head_after(const Run* a, const Run* b);
+
+  // sort the table into a vector by QNAME, and clear it
+  std::vector<PendingRead> drain();
+
+  static bool write_read(FILE* fp, const PendingRead& p);
+  static bool read_read(FILE* fp, PendingRead& p);
+
+  size_t m_budget;
+
+  size_t m_bytes = 0;
+
+  std::unordered_map<std::string, PendingRead> m_table;
+
+  std::vector<FILE*> m_runs;
+
+  size_t m_spills = 0;
+
+  // state of the final merge
+  std::vector<Run> m_merge;
+  std::vector<Run*> m_heap;
+  bool m_merging = false;
+
+};
+
+#endif
@@ -0,0 +1,89 @@
+#include "QnameRenamer.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "htslib/khash.h"
+
+#include "VariantBamError.h"
+
+// length of a new name, without the NUL. 11 base-64 digits hold 64 bits,
+// and 12 bytes with the NUL keep the CIGAR 4-byte aligned
+static const int ID_LEN = 11;
+
+// characters allowed in a QNAME, that don't look like a /1 or /2 suffix
+static const char ID_DIGITS[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz-_";
+
+// htslib 1.4 and later pad the name with extra NULs to align the CIGAR, and
+// count them in l_extranul. The new name needs none
+template <typename T>
+static auto clear_extranul(T& core, int) -> decltype(core.l_extranul = 0, void()) { core.l_extranul = 0; }
+template <typename T>
+static void clear_extranul(T&, long) {}
+
+uint32_t QnameHash(const char* qname, int seed) {
+  return __ac_Wang_hash(__ac_X31_hash_string(qname) ^ seed);
+}
+
+// FNV-1a, for the low half of the id
+static uint32_t fnv_hash(const char* s, int seed) {
+  uint32_t h = 2166136261u ^ (uint32_t)seed;
+  for (; *s; ++s)
+    h = (h ^ (uint8_t)*s) * 16777619u;
+  return h;
+}
+
+bool QnameRenamer::OpenMap(const std::string& map) {
+
+  m_map_file = map;
+  m_map = fopen(map.c_str(), "w");
+  return m_map != nullptr;
+
+}
+
+void QnameRenamer::Apply(bam1_t* b) {
+
+  const char* qname = bam_get_qname(b);
+  uint64_t key = ((uint64_t)QnameHash(qname, m_seed) << 32) | fnv_hash(qname, m_seed);
+
+  char id[ID_LEN + 1];
+  for (int i = ID_LEN - 1; i >= 0; --i, key >>= 6)
+    id[i] = ID_DIGITS[key & 63];
+  id[ID_LEN] = '\0';
+
+  const bool primary = !(b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY));
+  if (m_map && primary && std::strcmp(id, m_last) != 0) {
+    if (fprintf(m_map, "%s\t%s\n", id, qname) < 0)
+      throw VariantBamError("could not write read name map " + m_map_file);
+    std::memcpy(m_last, id, sizeof(id));
+  }
+
+  // shift the rest of the record up to the new end of the name. Names
+  // shorter than the id are rare, but make the record grow
+  const int old_len = b->core.l_qname;
+  const uint32_t l_data = b->l_data - old_len + ID_LEN + 1;
+  if (l_data > b->m_data) {
+    uint8_t* d = (uint8_t*)realloc(b->data, l_data);
+    if (!d)
+      throw std::bad_alloc();
+    b->data = d;
+    b->m_data = l_data;
+  }
+  std::memmove(b->data + ID_LEN + 1, b->data + old_len, b->l_data - old_len);
+  std::memcpy(b->data, id, ID_LEN + 1);
+  b->l_data = l_data;
+  b->core.l_qname = ID_LEN + 1;
+  clear_extranul(b->core, 0);
+
+}
+
+void QnameRenamer::Close() {
+
+  if (m_map && fclose(m_map) != 0) {
+    m_map = nullptr;
+    throw VariantBamError("could not write read name map " + m_map_file);
+  }
+  m_map = nullptr;
+
+}
@@ -0,0 +1,65 @@
+#ifndef VARIANT_QNAME_RENAMER_H__
+#define VARIANT_QNAME_RENAMER_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include "htslib/sam.h"
+
+/** Hash of a read name, as used by the -m sampling. Mates hash alike */
+uint32_t QnameHash(const char* qname, int seed);
+
+/** Replace read names with short ids, to make the output smaller.
+ *
+ * The id is 64 bits of hash of the name, written as 11 characters: the
+ * -m sampling hash (QnameHash), then a second hash of the name. So it is
+ * the same on every run, mates share it without either being held, and
+ * reads with the same id were sampled alike by -m. Optionally, each new
+ * name is written with the old one to a tab-separated map file.
+ */
+class QnameRenamer {
+
+ public:
+
+  QnameRenamer() {}
+
+  ~QnameRenamer() { if (m_map) fclose(m_map); }
+
+  QnameRenamer(const QnameRenamer&) = delete;
+  QnameRenamer& operator=(const QnameRenamer&) = delete;
+
+  /** Start renaming
+   * @param seed Seed of the hash, as for -m
+   */
+  void Init(int seed) { m_active = true; m_seed = seed; }
+
+  /** Also write "<new name>\t<old name>" lines to a file. Return false if
+   * it can't be opened */
+  bool OpenMap(const std::string& map);
+
+  bool IsActive() const { return m_active; }
+
+  /** Rename a record in place. Primary alignments add a line to the map,
+   * unless the last line had the same name (as for mates written together).
+   * Throws VariantBamError if the map can't be written */
+  void Apply(bam1_t* b);
+
+  /** Close the map file */
+  void Close();
+
+ private:
+
+  bool m_active = false;
+
+  int m_seed = 0;
+
+  std::string m_map_file;
+  FILE* m_map = nullptr;
+
+  // last name written to the map
+  char m_last[12] = {};
+
+};
+
+#endif
@@ -0,0 +1,97 @@
+#include "QualityBinner.h"
+
+#include <cstdlib>
+#include <sstream>
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+// Illumina's 8-level binning. No-calls (0 and 1) are left alone
+static const char* ILLUMINA_BINS = "2-9:6,10-19:15,20-24:22,25-29:27,30-34:33,35-39:37,40-:40";
+
+// highest quality that can be binned. 255 marks a missing quality string
+static const long MAX_QUAL = 254;
+
+// parse a whole string as a quality, false if it isn't one
+static bool parse_qual(const std::string& s, long& q) {
+
+  if (s.empty())
+    return false;
+  char* end;
+  q = strtol(s.c_str(), &end, 10);
+  return *end == '\0' && q >= 0 && q <= MAX_QUAL;
+}
+
+QualityBinner::QualityBinner(const std::string& spec) {
+
+  for (int i = 0; i < 256; ++i)
+    m_table[i] = i;
+
+  std::istringstream iss(spec == "illumina" ? ILLUMINA_BINS : spec);
+  std::string val;
+  while (std::getline(iss, val, ',')) {
+
+    // <low>-<high>:<value>, <low>-:<value> or <quality>:<value>
+    size_t colon = val.find(':');
+    size_t dash = val.find('-');
+    long lo = 0, hi = MAX_QUAL, to = 0;
+    if (colon == std::string::npos || !parse_qual(val.substr(colon + 1), to)) {
+      m_valid = false;
+      return;
+    }
+    if (dash == std::string::npos || dash > colon) {
+      m_valid = parse_qual(val.substr(0, colon), lo);
+      hi = lo;
+    } else {
+      m_valid = parse_qual(val.substr(0, dash), lo) &&
+	(dash + 1 == colon || parse_qual(val.substr(dash + 1, colon - dash - 1), hi)) && lo <= hi;
+    }
+    if (!m_valid)
+      return;
+
+    for (long q = lo; q <= hi; ++q)
+      m_table[q] = to;
+    m_active = true;
+  }
+
+}
+
+void QualityBinner::Apply(bam1_t* b) const {
+
+  uint8_t* q = bam_get_qual(b);
+  const size_t n = b->core.l_qseq;
+  if (!n || q[0] == 0xff)
+    return;
+
+  size_t i = 0;
+
+#ifdef __SSSE3__
+  // qualities under 128 are looked up in eight 16-entry slices of the table,
+  // each picked out by the high nibble of the quality
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  __m128i slice[8];
+  for (int k = 0; k < 8; ++k)
+    slice[k] = _mm_loadu_si128((const __m128i*)(m_table + 16 * k));
+
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(q + i));
+    if (_mm_movemask_epi8(v)) { // 128 or more, so not in a slice
+      for (size_t j = i; j < i + 16; ++j)
+	q[j] = m_table[q[j]];
+      continue;
+    }
+    __m128i lo = _mm_and_si128(v, nibble);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+    __m128i out = _mm_setzero_si128();
+    for (int k = 0; k < 8; ++k)
+      out = _mm_or_si128(out, _mm_and_si128(_mm_shuffle_epi8(slice[k], lo),
+					    _mm_cmpeq_epi8(hi, _mm_set1_epi8(k))));
+    _mm_storeu_si128((__m128i*)(q + i), out);
+  }
+#endif
+
+  for (; i < n; ++i)
+    q[i] = m_table[q[i]];
+
+}
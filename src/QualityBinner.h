@@ -0,0 +1,50 @@
+#ifndef VARIANT_QUALITY_BINNER_H__
+#define VARIANT_QUALITY_BINNER_H__
+
+#include <cstdint>
+#include <string>
+
+#include "htslib/sam.h"
+
+/** Bin the base qualities of a record in place, to make the output smaller.
+ *
+ * The bins are compiled into a 256-entry table from each quality to its
+ * binned value, so binning is one lookup per base. Built with SSSE3, 16
+ * bases at a time are looked up with byte shuffles. Qualities outside
+ * every bin are left as they are, as is a missing quality string.
+ */
+class QualityBinner {
+
+ public:
+
+  /** Construct a binner that does nothing */
+  QualityBinner() {}
+
+  /** Construct a binner from a scheme
+   * @param spec "illumina" for the 8-level Illumina bins, or a comma-separated
+   * list of <low>-<high>:<value>, e.g. "2-19:12,20-29:25,30-:37". A missing
+   * high end runs to the top. Check IsValid after
+   */
+  QualityBinner(const std::string& spec);
+
+  /** Return true if there are bins to apply */
+  bool IsActive() const { return m_active; }
+
+  /** Return false if the scheme could not be parsed */
+  bool IsValid() const { return m_valid; }
+
+  /** Replace each quality of the record by its bin */
+  void Apply(bam1_t* b) const;
+
+ private:
+
+  // binned value of each quality
+  uint8_t m_table[256] = {};
+
+  bool m_active = false;
+
+  bool m_valid = true;
+
+};
+
+#endif
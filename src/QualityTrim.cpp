@@ -0,0 +1,196 @@
+#include "QualityTrim.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+// make room for size bytes of record data
+static void reserve_data(bam1_t* b, uint32_t size) {
+
+  if (size <= b->m_data)
+    return;
+
+  uint32_t m = size + (size >> 1);
+  uint8_t* d = (uint8_t*)realloc(b->data, m);
+  if (!d)
+    throw std::bad_alloc();
+  b->data = d;
+  b->m_data = m;
+}
+
+// remove n query bases from one end of the live ops [lo, hi), adding them
+// (and any hard clips already there) to hard. Ops left at the new end that
+// don't consume the query (D, N, P) are dropped too. Returns the number of
+// reference bases removed
+static int32_t clip_cigar(std::vector<uint32_t>& c, size_t& lo, size_t& hi, int32_t n, bool front, uint32_t& hard) {
+
+  while (lo < hi) {
+    uint32_t op = front ? c[lo] : c[hi - 1];
+    if (bam_cigar_op(op) != BAM_CHARD_CLIP)
+      break;
+    hard += bam_cigar_oplen(op);
+    front ? ++lo : --hi;
+  }
+
+  if (n <= 0)
+    return 0;
+  hard += n;
+
+  int32_t ref = 0;
+  while (lo < hi) {
+    uint32_t& op = front ? c[lo] : c[hi - 1];
+    int type = bam_cigar_type(bam_cigar_op(op));
+    uint32_t len = bam_cigar_oplen(op);
+
+    if (type & 1) { // consumes the query
+      if (!n)
+	break;
+      uint32_t k = std::min<uint32_t>(n, len);
+      n -= k;
+      if (type & 2)
+	ref += k;
+      if (k < len) {
+	op = bam_cigar_gen(len - k, bam_cigar_op(op));
+	continue;
+      }
+    } else if (type & 2) {
+      ref += len;
+    }
+    front ? ++lo : --hi;
+  }
+
+  return ref;
+}
+
+bool QualityTrimBounds(const bam1_t* b, int phred, int32_t& start, int32_t& end) {
+
+  start = 0;
+  end = b->core.l_qseq;
+
+  const uint8_t* q = bam_get_qual(b);
+  if (!end || q[0] == 0xff) // no qualities
+    return false;
+
+  int32_t s = 0;
+  while (s < end && q[s] < phred)
+    ++s;
+  if (s == end) // nothing good
+    return false;
+
+  int32_t e = end;
+  while (q[e - 1] < phred)
+    --e;
+
+  // as before, a stretch shorter than the bases cut from the front isn't
+  // trimmed (or given a GV tag) either
+  if (e - s >= end || e - s < s)
+    return false;
+
+  start = s;
+  end = e;
+  return true;
+}
+
+void AddTrimmedSequenceTag(bam1_t* b, int32_t start, int32_t end) {
+
+  int32_t len = end - start;
+  uint32_t l_data = b->l_data + 3 + len + 1;
+  reserve_data(b, l_data);
+
+  const uint8_t* seq = bam_get_seq(b);
+  uint8_t* p = b->data + b->l_data;
+  *p++ = 'G';
+  *p++ = 'V';
+  *p++ = 'Z';
+  for (int32_t i = start; i < end; ++i)
+    *p++ = seq_nt16_str[bam_seqi(seq, i)];
+  *p = '\0';
+
+  b->l_data = l_data;
+}
+
+void TrimRecord(bam1_t* b, int32_t start, int32_t end, std::vector<uint32_t>& cigar) {
+
+  bam1_core_t& c = b->core;
+  int32_t len = end - start;
+  if (start < 0 || end > c.l_qseq || len < 0)
+    return;
+
+  // the new CIGAR, with the trimmed bases as hard clips
+  bool new_cigar = c.n_cigar && len < c.l_qseq;
+  int32_t ref_shift = 0;
+  bool unmap = false;
+  if (new_cigar) {
+    cigar.assign(bam_get_cigar(b), bam_get_cigar(b) + c.n_cigar);
+    size_t lo = 0, hi = cigar.size();
+    uint32_t hard_front = 0, hard_back = 0;
+    ref_shift = clip_cigar(cigar, lo, hi, start, true, hard_front);
+    clip_cigar(cigar, lo, hi, c.l_qseq - end, false, hard_back);
+    cigar.erase(cigar.begin() + hi, cigar.end());
+    cigar.erase(cigar.begin(), cigar.begin() + lo);
+    if (hard_front)
+      cigar.insert(cigar.begin(), bam_cigar_gen(hard_front, BAM_CHARD_CLIP));
+    if (hard_back)
+      cigar.push_back(bam_cigar_gen(hard_back, BAM_CHARD_CLIP));
+
+    // a mapped read needs an aligned base. Without one, keep the position so
+    // the read still sorts where it was, but as a placed unmapped read
+    unmap = !(c.flag & BAM_FUNMAP) && std::none_of(cigar.begin(), cigar.end(), [](uint32_t op) {
+	int o = bam_cigar_op(op);
+	return o == BAM_CMATCH || o == BAM_CEQUAL || o == BAM_CDIFF;
+      });
+    if (unmap)
+      cigar.clear();
+  }
+  uint32_t n_cigar = new_cigar ? cigar.size() : c.n_cigar;
+
+  // offsets of the sequence and aux blocks, before and after
+  int32_t seq0 = c.l_qname + (c.n_cigar << 2);
+  int32_t seq1 = c.l_qname + (n_cigar << 2);
+  int32_t l_seq1 = (len + 1) >> 1;
+  int32_t aux0 = seq0 + ((c.l_qseq + 1) >> 1) + c.l_qseq;
+  int32_t aux1 = seq1 + l_seq1 + len;
+  int32_t l_aux = b->l_data - aux0;
+
+  reserve_data(b, aux1 + l_aux);
+  uint8_t* d = b->data;
+
+  // pack the kept bases to the front of the old sequence. Base start + i
+  // is always read before base i is written
+  if (start) {
+    uint8_t* seq = d + seq0;
+    for (int32_t i = 0; i < len; ++i) {
+      uint8_t base = bam_seqi(seq, start + i);
+      seq[i >> 1] = (i & 1) ? (seq[i >> 1] & 0xf0) | base : (seq[i >> 1] & 0x0f) | (base << 4);
+    }
+  }
+  if (len & 1)
+    d[seq0 + (len >> 1)] &= 0xf0;
+
+  // move the blocks into place. If the aux block moves right, move it first
+  // so the sequence doesn't land on it
+  if (aux1 > aux0) {
+    memmove(d + aux1, d + aux0, l_aux);
+    memmove(d + seq1, d + seq0, l_seq1);
+  } else {
+    memmove(d + seq1, d + seq0, l_seq1);
+    memmove(d + aux1, d + aux0, l_aux);
+  }
+  memset(d + seq1 + l_seq1, 0xff, len);
+  if (new_cigar)
+    memcpy(d + c.l_qname, cigar.data(), n_cigar << 2);
+
+  c.n_cigar = n_cigar;
+  c.l_qseq = len;
+  b->l_data = aux1 + l_aux;
+
+  if (unmap) {
+    c.flag = (c.flag | BAM_FUNMAP) & ~BAM_FPROPER_PAIR;
+    c.qual = 0;
+    c.bin = hts_reg2bin(c.pos, c.pos + 1, 14, 5);
+  } else if (new_cigar && !(c.flag & BAM_FUNMAP)) {
+    c.pos += ref_shift;
+    c.bin = hts_reg2bin(c.pos, bam_endpos(b), 14, 5);
+  }
+}
@@ -0,0 +1,37 @@
+#ifndef VARIANT_QUALITY_TRIM_H__
+#define VARIANT_QUALITY_TRIM_H__
+
+#include <vector>
+#include <cstdint>
+
+#include "htslib/sam.h"
+
+/** Find the high-quality stretch of a read.
+ *
+ * The stretch runs from the first base with quality >= phred to the last.
+ * @param b Record to look at
+ * @param phred Minimum base quality
+ * @param start Set to the first base of the stretch
+ * @param end Set to one past the last base of the stretch
+ * @return true if the stretch is shorter than the read, not empty, and at
+ * least as long as the bases before it. Otherwise start and end cover the
+ * whole read.
+ */
+bool QualityTrimBounds(const bam1_t* b, int phred, int32_t& start, int32_t& end);
+
+/** Append the bases [start, end) as a GV tag, decoding them straight from
+ * the packed sequence */
+void AddTrimmedSequenceTag(bam1_t* b, int32_t start, int32_t end);
+
+/** Trim a record down to the bases [start, end) in place, and remove the
+ * quality scores.
+ *
+ * The packed sequence is shifted down, and the record is grown only if the
+ * CIGAR gains an op. Trimmed bases become hard clips. Bases trimmed from the
+ * aligned part of the read move the position forward. If no M, = or X op
+ * is left, the read is set unmapped at its old position, with no CIGAR.
+ * @param cigar Scratch space for the new CIGAR, reused between calls
+ */
+void TrimRecord(bam1_t* b, int32_t start, int32_t end, std::vector<uint32_t>& cigar);
+
+#endif
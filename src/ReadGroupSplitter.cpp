@@ -0,0 +1,121 @@
+#include "ReadGroupSplitter.h"
+
+#include <algorithm>
+#include <cctype>
+#include <sstream>
+#include <sys/stat.h>
+
+#include "VariantBamError.h"
+
+// size of the empty block that ends a BGZF file
+static const int64_t BGZF_EOF_SIZE = 28;
+
+// read group names can hold anything but tabs, so keep file names tame
+static std::string file_safe(const std::string& rg) {
+
+  std::string s = rg.empty() ? "none" : rg;
+  for (auto& c : s)
+    if (!isalnum(c) && c != '.' && c != '-' && c != '_')
+      c = '_';
+  return s;
+}
+
+void ReadGroupSplitter::Init(const std::string& prefix, const std::string& suffix, const OutputWriter& proto,
+			     const SeqLib::BamHeader& hdr, const SeqLib::ThreadPool& pool, size_t max_open) {
+
+  m_prefix = prefix;
+  m_suffix = suffix;
+  m_proto = proto;
+  m_hdr = hdr;
+  m_pool = pool;
+  m_max_open = std::max<size_t>(max_open, 1);
+
+}
+
+OutputWriter& ReadGroupSplitter::Writer(const std::string& rg) {
+
+  if (m_last && rg == m_last_rg)
+    return m_last->writer;
+
+  Group& g = m_groups[rg];
+  if (g.writer.IsOpen()) {
+    m_open.splice(m_open.begin(), m_open, g.lru);
+  } else {
+    if (g.file.empty()) {
+      // two groups can clean up to the same name
+      std::string base = m_prefix + file_safe(rg);
+      g.file = base + m_suffix;
+      for (int i = 2; !m_files.insert(g.file).second; ++i)
+	g.file = base + "_" + std::to_string(i) + m_suffix;
+    }
+    open(rg, g);
+  }
+
+  m_last = &g;
+  m_last_rg = rg;
+  return g.writer;
+}
+
+void ReadGroupSplitter::open(const std::string& rg, Group& g) {
+
+  if (m_open.size() >= m_max_open) {
+    Group& lru = m_groups[m_open.back()];
+    lru.writer.Close();
+    m_open.pop_back();
+    m_last = nullptr;
+    ++m_reopens;
+  }
+
+  g.writer = m_proto;
+  g.writer.SetHeader(group_header(rg));
+
+  bool ok;
+  if (!g.started) {
+    ok = g.writer.Open(g.file) && g.writer.WriteHeader();
+    g.started = true;
+  } else {
+    // write over the EOF block that Close added
+    struct stat st;
+    ok = stat(g.file.c_str(), &st) == 0 && st.st_size >= BGZF_EOF_SIZE &&
+      g.writer.OpenAppend(g.file, st.st_size - BGZF_EOF_SIZE);
+  }
+
+  if (!ok)
+    throw VariantBamError("could not open output " + g.file + " for read group " + rg);
+
+  if (m_pool.IsOpen())
+    g.writer.SetThreadPool(m_pool);
+
+  m_open.push_front(rg);
+  g.lru = m_open.begin();
+
+}
+
+SeqLib::BamHeader ReadGroupSplitter::group_header(const std::string& rg) const {
+
+  if (m_hdr.isEmpty())
+    return m_hdr;
+
+  const std::string id = "\tID:" + rg;
+  std::istringstream in(m_hdr.AsString());
+  std::string line, out;
+  while (std::getline(in, line)) {
+    if (line.compare(0, 3, "@RG") == 0) {
+      size_t p = line.find(id);
+      if (p == std::string::npos || (p + id.size() < line.size() && line[p + id.size()] != '\t'))
+	continue;
+    }
+    out += line + "\n";
+  }
+
+  return SeqLib::BamHeader(out);
+}
+
+void ReadGroupSplitter::Close() {
+
+  for (const auto& rg : m_open)
+    m_groups[rg].writer.Close();
+  m_open.clear();
+  m_last = nullptr;
+
+}
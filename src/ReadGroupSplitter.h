@@ -0,0 +1,96 @@
+#ifndef VARIANT_READ_GROUP_SPLITTER_H__
+#define VARIANT_READ_GROUP_SPLITTER_H__
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "SeqLib/BamHeader.h"
+#include "SeqLib/ThreadPool.h"
+
+#include "OutputWriter.h"
+
+/** Write each read group to its own file, in one pass.
+ *
+ * Files are opened when the first read of their group arrives, with a
+ * header holding only that group's @RG line. At most max_open are open at
+ * once, all compressing on the one thread pool. Past that, the least
+ * recently written is closed, and reopened for appending (after its BGZF
+ * EOF block) when its group comes round again. So the output has to be
+ * BGZF: BAM, or compressed FASTQ.
+ */
+class ReadGroupSplitter {
+
+ public:
+
+  ReadGroupSplitter() {}
+
+  /** Start splitting
+   * @param prefix Files are named <prefix><read group><suffix>
+   * @param suffix e.g. ".bam"
+   * @param proto Unopened writer to copy for each group, to set the format
+   * @param hdr Header of the input
+   * @param pool Thread pool to compress on. May be unopened
+   * @param max_open Most files to hold open at once
+   */
+  void Init(const std::string& prefix, const std::string& suffix, const OutputWriter& proto,
+	    const SeqLib::BamHeader& hdr, const SeqLib::ThreadPool& pool, size_t max_open);
+
+  bool IsActive() const { return !m_prefix.empty(); }
+
+  /** Return the open writer for a read group, opening (or reopening) its file.
+   * Throws VariantBamError if the file can't be opened */
+  OutputWriter& Writer(const std::string& rg);
+
+  /** Close all of the files */
+  void Close();
+
+  /** Number of read groups seen */
+  size_t NumGroups() const { return m_groups.size(); }
+
+  /** Number of times a file was closed to make room for another */
+  size_t NumReopens() const { return m_reopens; }
+
+ private:
+
+  struct Group {
+    OutputWriter writer;
+    std::string file;
+    bool started = false; // header written, so reopen to append
+    std::list<std::string>::iterator lru;
+  };
+
+  // open the file of g, closing the least recently used one if needed
+  void open(const std::string& rg, Group& g);
+
+  // the input header, with only the @RG line of rg
+  SeqLib::BamHeader group_header(const std::string& rg) const;
+
+  std::string m_prefix, m_suffix;
+
+  OutputWriter m_proto;
+
+  SeqLib::BamHeader m_hdr;
+
+  SeqLib::ThreadPool m_pool;
+
+  size_t m_max_open = 1;
+
+  std::unordered_map<std::string, Group> m_groups;
+
+  std::unordered_set<std::string> m_files;
+
+  // read groups with an open file, most recently written first
+  std::list<std::string> m_open;
+
+  // last group written, to skip the lookup for runs of reads from one group
+  Group* m_last = nullptr;
+  std::string m_last_rg;
+
+  size_t m_reopens = 0;
+
+};
+
+#endif
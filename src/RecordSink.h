@@ -0,0 +1,44 @@
+#ifndef VARIANT_RECORD_SINK_H__
+#define VARIANT_RECORD_SINK_H__
+
+#include <functional>
+#include <string>
+
+#include "htslib/sam.h"
+
+/** Receives the kept reads of a VariantBamWalker run in memory.
+ *
+ * When set, the walker hands each kept read to the sink instead of writing
+ * it to a file, after -Z trimming and tag stripping. The record belongs to
+ * the walker and is only valid during the call, so copy it (bam_dup1) to
+ * keep it.
+ */
+class RecordSink {
+
+ public:
+
+  virtual ~RecordSink() {}
+
+  /** Take a kept read
+   * @return false to stop the run after this read
+   */
+  virtual bool Write(const bam1_t* b) = 0;
+
+};
+
+/** Sink that calls a function for each kept read */
+class CallbackSink : public RecordSink {
+
+ public:
+
+  CallbackSink(std::function<bool(const bam1_t*)> f) : m_f(f) {}
+
+  bool Write(const bam1_t* b) { return m_f(b); }
+
+ private:
+
+  std::function<bool(const bam1_t*)> m_f;
+
+};
+
+#endif
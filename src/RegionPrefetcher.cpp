@@ -0,0 +1,142 @@
+#include "RegionPrefetcher.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "htslib/sam.h"
+
+// regions past the current one to look for the reader in
+static const size_t LOOKAHEAD = 16;
+
+// the last block of a chunk starts at its end offset, and is at most this big
+static const uint64_t MAX_BLOCK = 65536;
+
+bool RegionPrefetcher::Start(const std::string& fn, const SeqLib::GRC& regions, size_t window) {
+
+  if (m_thread.joinable() || window == 0 || regions.size() < 2)
+    return false;
+
+  htsFile* fp = hts_open(fn.c_str(), "r");
+  hts_idx_t* idx = fp && hts_get_format(fp)->format == bam ? sam_index_load(fp, fn.c_str()) : nullptr;
+  if (!idx) {
+    if (fp)
+      hts_close(fp);
+    return false;
+  }
+
+  m_ranges.clear();
+  for (const auto& g : regions) {
+    Range r = { g.chr, g.pos1, g.pos2, 0, 0 };
+    hts_itr_t* itr = g.chr >= 0 ? sam_itr_queryi(idx, g.chr, std::max(g.pos1 - 1, 0), g.pos2) : nullptr;
+    if (itr && itr->n_off) {
+      r.beg = UINT64_MAX;
+      for (int i = 0; i < itr->n_off; ++i) {
+	r.beg = std::min(r.beg, itr->off[i].u >> 16);
+	r.end = std::max(r.end, (itr->off[i].v >> 16) + MAX_BLOCK);
+      }
+    }
+    if (itr)
+      hts_itr_destroy(itr);
+    m_ranges.push_back(r);
+  }
+
+  hts_idx_destroy(idx);
+  hts_close(fp);
+
+  m_ahead.assign(1, 0);
+  for (const auto& r : m_ranges)
+    m_ahead.push_back(m_ahead.back() + (r.end - r.beg));
+
+  m_fd = open(fn.c_str(), O_RDONLY);
+  if (m_fd < 0) {
+    m_ranges.clear();
+    return false;
+  }
+
+  m_window = window;
+  m_current = 0;
+  m_next = 1;
+  m_stop = false;
+  m_thread = std::thread(&RegionPrefetcher::run, this);
+
+  return true;
+}
+
+void RegionPrefetcher::Stop() {
+
+  if (!m_thread.joinable())
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_cv.notify_all();
+  m_thread.join();
+
+  close(m_fd);
+  m_fd = -1;
+  m_ranges.clear();
+
+}
+
+void RegionPrefetcher::advance(int32_t chr, int32_t pos, int32_t end) {
+
+  size_t last = std::min(m_ranges.size(), m_current + 1 + LOOKAHEAD);
+  for (size_t i = m_current + 1; i < last; ++i)
+    if (in_region(i, chr, pos, end)) {
+      {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_current = i;
+      }
+      m_cv.notify_one();
+      return;
+    }
+
+}
+
+void RegionPrefetcher::run() {
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  while (!m_stop) {
+
+    // nothing to gain from regions the reader has already reached
+    m_next = std::max(m_next, m_current + 1);
+
+    // always the next region (up to the window), then as many as fit
+    bool more = m_next < m_ranges.size() &&
+      (m_next == m_current + 1 || m_ahead[m_next + 1] - m_ahead[m_current + 1] <= m_window);
+
+    if (!more) {
+      m_cv.wait(lock);
+      continue;
+    }
+
+    Range r = m_ranges[m_next++];
+    lock.unlock();
+    if (r.end > r.beg)
+      fetch(r.beg, std::min(r.end, r.beg + m_window));
+    lock.lock();
+  }
+
+}
+
+void RegionPrefetcher::fetch(uint64_t beg, uint64_t end) {
+
+#ifdef POSIX_FADV_WILLNEED
+  posix_fadvise(m_fd, beg, end - beg, POSIX_FADV_WILLNEED);
+#endif
+
+  // some network file systems ignore the advice, so read it too
+  static const size_t CHUNK = 1 << 20;
+  std::vector<char> buf(std::min<uint64_t>(CHUNK, end - beg));
+  for (uint64_t off = beg; off < end; ) {
+    ssize_t n = pread(m_fd, buf.data(), std::min<uint64_t>(buf.size(), end - off), off);
+    if (n <= 0)
+      break;
+    off += n;
+  }
+
+}
@@ -0,0 +1,96 @@
+#ifndef VARIANT_REGION_PREFETCHER_H__
+#define VARIANT_REGION_PREFETCHER_H__
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "SeqLib/GenomicRegionCollection.h"
+
+/** Read the file blocks of upcoming regions ahead of the reader.
+ *
+ * The byte range of each region is looked up in the BAM index up front.
+ * While the reader is in region N, a background thread reads the blocks of
+ * regions N+1, N+2, ... into the page cache with pread, up to a window of
+ * bytes ahead, so the seek and transfer of the next region overlap with the
+ * filtering of this one. The window bounds the memory it can fill. This
+ * pays off on network storage, where every region otherwise starts with a
+ * round trip.
+ */
+class RegionPrefetcher {
+
+ public:
+
+  RegionPrefetcher() {}
+
+  ~RegionPrefetcher() { Stop(); }
+
+  RegionPrefetcher(const RegionPrefetcher&) = delete;
+  RegionPrefetcher& operator=(const RegionPrefetcher&) = delete;
+
+  /** Start reading ahead on a background thread
+   * @param fn Indexed BAM file being read
+   * @param regions Regions, in the order they will be read
+   * @param window Bytes to read ahead of the current region
+   * @return false (and nothing started) if fn isn't an indexed BAM
+   */
+  bool Start(const std::string& fn, const SeqLib::GRC& regions, size_t window);
+
+  /** Tell the prefetcher where the reader is. Cheap unless the read is in a new region */
+  void Update(int32_t chr, int32_t pos, int32_t end) {
+    if (m_ranges.size() && !in_region(m_current, chr, pos, end))
+      advance(chr, pos, end);
+  }
+
+  /** Stop the thread */
+  void Stop();
+
+ private:
+
+  // a region, and the part of the file that holds its reads
+  struct Range {
+    int32_t chr, pos1, pos2;
+    uint64_t beg, end;
+  };
+
+  bool in_region(size_t i, int32_t chr, int32_t pos, int32_t end) const {
+    const Range& r = m_ranges[i];
+    return r.chr == chr && pos <= r.pos2 && end >= r.pos1;
+  }
+
+  // move m_current to the region holding the read, if it is one of the next few
+  void advance(int32_t chr, int32_t pos, int32_t end);
+
+  void run();
+
+  // read [beg, end) of the file, and drop it
+  void fetch(uint64_t beg, uint64_t end);
+
+  std::vector<Range> m_ranges;
+
+  // m_ahead[i] is the bytes of regions 0..i-1
+  std::vector<uint64_t> m_ahead;
+
+  size_t m_window = 0;
+
+  int m_fd = -1;
+
+  // region being read, set by the reader
+  size_t m_current = 0;
+
+  // next region to fetch, owned by the thread
+  size_t m_next = 1;
+
+  std::thread m_thread;
+
+  std::mutex m_mutex;
+
+  std::condition_variable m_cv;
+
+  bool m_stop = false;
+
+};
+
+#endif
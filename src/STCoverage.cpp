@@ -21,69 +21,73 @@
     return (*std::max_element(v->begin(), v->end()));
   }
 
+size_t STCoverage::MemoryUsage() const {
+
+  size_t b = m_map.capacity() * sizeof(CovSteps);
+  for (const auto& m : m_map)
+    b += (m.ends.capacity() + m.steps.capacity()) * sizeof(std::pair<int32_t, int32_t>);
+  return b;
+}
+
+// add one to the coverage of [p, e)
+static inline void add_range(CovSteps& m, int32_t p, int32_t e) {
+  if (p >= e)
+    return;
+  m.ends.push_back(std::make_pair(p, 1));
+  m.ends.push_back(std::make_pair(e, -1));
+  m.settled = false;
+}
+
+// sum the sorted range ends into the depth at each position where it changes
+static void settle(const CovSteps& m) {
+  std::sort(m.ends.begin(), m.ends.end());
+  m.steps.clear();
+  int32_t depth = 0;
+  for (size_t i = 0; i < m.ends.size();) {
+    const int32_t p = m.ends[i].first;
+    for (; i < m.ends.size() && m.ends[i].first == p; ++i)
+      depth += m.ends[i].second;
+    m.steps.push_back(std::make_pair(p, depth));
+  }
+  m.settled = true;
+}
+
 void STCoverage::addRead(const SeqLib::BamRecord &r, int buff, bool full_length) {
-    
-    //m_settled = false;
-    //m_grc.add(GenomicRegion(r.ChrID(), r.Position(), r.PositionEnd()));
-    
-    // out of bounds
-    //if (r.Position() < m_gr.pos1 || r.PositionEnd() > m_gr.pos2 || r.ChrID() != m_gr.chr)
-    //  return;
-
-    //int p = std::min(r.Position() - m_gr.pos1, m_gr.pos2);
-    //int e = std::min(r.PositionEnd() - m_gr.pos1, m_gr.pos2);
-    int p = -1; 
-    int e = -1;
-
-    if (full_length) {
-      SeqLib::Cigar c = r.GetCigar();
-      // get beginning
-      if (c.size() && c[0].RawType() == BAM_CSOFT_CLIP)
-	p = std::max((int32_t)0, r.Position() - (int32_t)c[0].Length()); // get prefixing S
-      else
-	p = r.Position();
-      // get end
-      if (c.size() && c.back().RawType() == BAM_CSOFT_CLIP)
-	e = r.PositionEnd() + c.back().Length();
-      else
-	e = r.PositionEnd();
-    }
-    else {
-      p = r.Position() + buff;
-      e = r.PositionEnd() - buff;
-    }
 
-    if (p < 0 || e < 0)
+    const bam1_t* b = r.raw();
+    const int32_t chr = b->core.tid;
+
+    if (chr < 0 || b->core.pos < 0 || !b->core.n_cigar)
       return;
 
     // if we don't have an empty map for this, add
-    if (r.ChrID() >= (int)m_map.size()) {
-      int k = m_map.size();
-      while (k <= r.ChrID()) {
-	m_map.push_back(CovMap());
-	//m_map.back().reserve(reserve_size);
-	++k;
-      }
-    }
-
-    assert(e - p < 1e6); // limit on read length
-    assert(r.ChrID() >= 0);
-    assert(r.ChrID() < (int)m_map.size());
-
-    try {
-       while (p <= e) {
-	//CovMap::iterator iter = m_map.find(p);
-	++(m_map[r.ChrID()][p]); // add one to this position
-	++p;
-	//if (v->at(p) < 60000) // 60000 is roughly int16 lim
-	//  v->at(p)++;
-	//++p;
-	
+    if (chr >= (int)m_map.size())
+      m_map.resize(chr + 1);
+    CovSteps& m = m_map[chr];
+
+    // only count the aligned blocks, not D and N spans. Without full_length,
+    // buff bases are left off each end of the alignment
+    int32_t lo = full_length ? 0 : b->core.pos + buff;
+    int32_t hi = full_length ? INT32_MAX : bam_endpos(b) - buff;
+
+    const uint32_t* cig = bam_get_cigar(b);
+    int32_t p = b->core.pos;
+    bool aligned = false; // seen an aligned block yet
+    for (uint32_t i = 0; i < b->core.n_cigar; ++i) {
+      const int op = bam_cigar_op(cig[i]);
+      const int32_t len = bam_cigar_oplen(cig[i]);
+      switch (op) {
+      case BAM_CMATCH: case BAM_CEQUAL: case BAM_CDIFF:
+	add_range(m, std::max(p, lo), std::min(p + len, hi));
+	aligned = true;
+	break;
+      case BAM_CSOFT_CLIP: // with full_length, count where the clipped bases would sit
+	if (full_length)
+	  aligned ? add_range(m, p, p + len) : add_range(m, std::max(0, p - len), p);
+	break;
       }
-    } catch (std::out_of_range &oor) {
-      std::cerr << "Position " << p << " on tid " << r.ChrID()
-		<< " is greater than expected max of " << v->size() << " -- skipping" << std::endl;
-      
+      if (bam_cigar_type(op) & 2)
+	p += len;
     }
     
   }
@@ -124,15 +128,15 @@ void STCoverage::ToBedgraph(std::ofstream * o, const SeqLib::BamHeader h) const
     if (chr < 0)
       return 0;
 
-    if (!m_map[chr].size())
-      return 0;
+    const CovSteps& m = m_map[chr];
+    if (!m.settled)
+      settle(m);
 
-    CovMap::const_iterator ff = m_map[chr].find(pos);
-    
-    if (ff == m_map[chr].end()) {
+    // the last step at or before pos
+    auto ff = std::upper_bound(m.steps.begin(), m.steps.end(), std::make_pair(pos, INT32_MAX));
+    if (ff == m.steps.begin())
       return 0;
-    }
 
-    return ff->second;
+    return (ff - 1)->second;
 
 }
@@ -20,12 +20,22 @@
 #include "SeqLib/GenomicRegionCollection.h"
 
 typedef std::shared_ptr<std::vector<uint16_t>> uint16_sp;
-typedef std::unordered_map<int,int> CovMap;
-//typedef std::unordered_map<int,CovMap> CovMapMap;
+
+/** The coverage of one chromosome, as the +1/-1 ends of the added ranges.
+ *
+ * The ends are sorted and summed into depth steps when the coverage is
+ * first looked up after an add.
+ */
+struct CovSteps {
+  mutable std::vector<std::pair<int32_t, int32_t>> ends;  // (pos, +1 or -1)
+  mutable std::vector<std::pair<int32_t, int32_t>> steps; // (pos, depth from pos on)
+  mutable bool settled = true;
+};
 
   /** Hold base-pair or binned coverage across an interval or genome
    *
-   * Currently stores coverage as an unordered_map.
+   * Stores each chromosome as ranges, so a read costs two entries per
+   * aligned block rather than one per base.
    */
 class STCoverage {
   
@@ -34,8 +44,7 @@ class STCoverage {
   SeqLib::GRC m_grc;
   SeqLib::GenomicRegion m_gr;
 
-  //CovMapMap m_map;
-  std::vector<CovMap> m_map;
+  std::vector<CovSteps> m_map;
 
   uint16_sp v;
 
@@ -49,10 +58,12 @@ class STCoverage {
   /** */
   void settleCoverage();
       
-  /** Add a read to this coverage track 
-   * @param reserve_size Upper bound estimate for size of map. Not a hard
-   *   cutoff but improves performance if total number of positions is less than this, 
-   *   as it will not rehash. */
+  /** Add a read to this coverage track.
+   *
+   * Walks the raw CIGAR and counts only the aligned (M, =, X) blocks, so
+   * deletions and spliced introns (N) get no coverage.
+   * @param buff Leave this many bases off each end of the alignment
+   * @param full_length Also count soft-clipped bases, where they would align. Ignores buff */
   void addRead(const SeqLib::BamRecord &r, int buff, bool full_length);
 
   /** Make a new coverage object at interval gr */
@@ -60,6 +71,9 @@ class STCoverage {
 
   uint16_t maxCov() const;
 
+  /** Return the bytes held by the coverage ranges */
+  size_t MemoryUsage() const;
+
   /** Make an empty coverage */
   STCoverage() {}
 
@@ -0,0 +1,91 @@
+#include "TagFilter.h"
+
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+// size of the value of an aux field of this type, not counting the tag and
+// type characters. Returns 0 if the field is malformed
+static size_t aux_value_size(const uint8_t* s, const uint8_t* end) {
+
+  switch (*s) {
+  case 'A': case 'c': case 'C': return 2;
+  case 's': case 'S': return 3;
+  case 'i': case 'I': case 'f': return 5;
+  case 'd': return 9;
+  case 'Z': case 'H': {
+    const uint8_t* p = s + 1;
+    while (p < end && *p)
+      ++p;
+    return p < end ? p - s + 1 : 0;
+  }
+  case 'B': {
+    if (s + 6 > end)
+      return 0;
+    uint32_t n;
+    std::memcpy(&n, s + 2, 4);
+    size_t w = 0;
+    switch (s[1]) {
+    case 'c': case 'C': w = 1; break;
+    case 's': case 'S': w = 2; break;
+    case 'i': case 'I': case 'f': w = 4; break;
+    default: return 0;
+    }
+    return 6 + w * n;
+  }
+  default:
+    return 0;
+  }
+}
+
+TagFilter::TagFilter(const std::string& tags, bool keep) : m_keep(keep) {
+
+  std::istringstream iss(tags);
+  std::string val;
+  while(std::getline(iss, val, ',')) {
+    if (val.length() != 2) {
+      std::cerr << "WARNING: ignoring tag \"" << val << "\". Tags are two characters" << std::endl;
+      continue;
+    }
+    m_tags.set(tag_index((const uint8_t*)val.c_str()));
+  }
+
+}
+
+void TagFilter::Apply(bam1_t* b) const {
+
+  uint8_t* aux = bam_get_aux(b);
+  uint8_t* end = aux + bam_get_l_aux(b);
+
+  uint8_t* src = aux; // next field to look at
+  uint8_t* dst = aux; // where the next kept field goes
+  uint8_t* run = aux; // start of the current run of kept fields
+
+  while (src + 3 <= end) {
+
+    size_t len = aux_value_size(src + 2, end);
+    if (!len || src + 2 + len > end)
+      break; // malformed, so leave the rest as is
+
+    bool listed = m_tags.test(tag_index(src));
+    if (listed == m_keep) { // keep it
+      src += 2 + len;
+      continue;
+    }
+
+    // drop this field. First shift down the kept fields before it
+    if (run != dst)
+      std::memmove(dst, run, src - run);
+    dst += src - run;
+    src += 2 + len;
+    run = src;
+  }
+
+  // shift down the last run (and anything unparsed)
+  if (run != dst)
+    std::memmove(dst, run, end - run);
+  dst += end - run;
+
+  b->l_data -= end - dst;
+
+}
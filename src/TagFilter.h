@@ -0,0 +1,45 @@
+#ifndef VARIANT_TAG_FILTER_H__
+#define VARIANT_TAG_FILTER_H__
+
+#include <bitset>
+#include <string>
+
+#include "htslib/sam.h"
+
+/** Remove alignment tags from a record in one pass over the aux block.
+ *
+ * The tag names are compiled into a table indexed by the two characters
+ * of the tag, so each tag is checked in O(1). In strip mode, the listed
+ * tags are removed. In keep mode, every tag except the listed ones is removed.
+ */
+class TagFilter {
+
+ public:
+
+  /** Construct a filter that does nothing */
+  TagFilter() {}
+
+  /** Construct a filter from a comma-separated list of tags
+   * @param tags List of two-character tags, e.g. "RG,MD,OQ"
+   * @param keep If true, remove every tag NOT in the list
+   */
+  TagFilter(const std::string& tags, bool keep);
+
+  /** Return true if the filter could remove anything */
+  bool IsActive() const { return m_keep || m_tags.any(); }
+
+  /** Remove the tags from a record, shifting the kept tags down in place */
+  void Apply(bam1_t* b) const;
+
+ private:
+
+  // index of a tag in the table
+  static size_t tag_index(const uint8_t* t) { return ((size_t)t[0] << 8) | t[1]; }
+
+  std::bitset<65536> m_tags; // tags in the list
+
+  bool m_keep = false; // keep the tags in the list, rather than strip them
+
+};
+
+#endif
@@ -0,0 +1,96 @@
+#include "ThreadScheduler.h"
+
+#include <algorithm>
+
+// batches in each measurement window
+static const int WINDOW_BATCHES = 8;
+
+// windows to stay put after a trial, before probing again
+static const int HOLD_WINDOWS = 16;
+
+// a trial is kept if it is at least this much faster
+static const double MIN_GAIN = 1.03;
+
+// shares of the time taken by evaluation, over which more threads are tried
+// and under which fewer are
+static const double EVAL_HIGH = 0.4;
+static const double EVAL_LOW = 0.15;
+
+void ThreadScheduler::SetMaxThreads(int max_threads) {
+
+  m_max = std::max(1, max_threads);
+
+  // start half way, so that either direction can be tried
+  m_threads = m_low = m_high = std::max(1, (m_max + 1) / 2);
+  m_trial = false;
+  m_hold = 0;
+
+}
+
+void ThreadScheduler::Record(double read_s, double eval_s, double write_s, size_t reads) {
+
+  m_read_s += read_s;
+  m_eval_s += eval_s;
+  m_write_s += write_s;
+  m_reads += reads;
+
+  if (++m_batches < WINDOW_BATCHES)
+    return;
+
+  adjust();
+
+  m_batches = 0;
+  m_read_s = m_eval_s = m_write_s = 0;
+  m_reads = 0;
+
+}
+
+void ThreadScheduler::adjust() {
+
+  double total = m_read_s + m_eval_s + m_write_s;
+  if (total <= 0)
+    return;
+  double rate = m_reads / total;
+
+  // keep the trial only if it paid off
+  if (m_trial) {
+    m_trial = false;
+    m_hold = HOLD_WINDOWS;
+    if (rate < m_prev_rate * MIN_GAIN)
+      m_threads = m_prev_threads;
+    else
+      ++m_changes;
+    m_low = std::min(m_low, m_threads);
+    m_high = std::max(m_high, m_threads);
+    return;
+  }
+
+  if (m_hold > 0) {
+    --m_hold;
+    return;
+  }
+
+  // evaluation is the bottleneck, or the pool could use the cores
+  double share = m_eval_s / total;
+  int next = m_threads;
+  if (share > EVAL_HIGH)
+    next = std::min(m_max, m_threads + 1);
+  else if (share < EVAL_LOW)
+    next = std::max(1, m_threads - 1);
+
+  if (next == m_threads)
+    return;
+
+  m_trial = true;
+  m_prev_threads = m_threads;
+  m_prev_rate = rate;
+  m_threads = next;
+
+}
+
+void ThreadScheduler::Report(std::ostream& out) const {
+
+  out << "...rules evaluated on " << m_threads << " of up to " << m_max << " threads (ranged "
+      << m_low << "-" << m_high << ", " << m_changes << " changes kept)" << std::endl;
+
+}
@@ -0,0 +1,69 @@
+#ifndef VARIANT_THREAD_SCHEDULER_H__
+#define VARIANT_THREAD_SCHEDULER_H__
+
+#include <cstddef>
+#include <iostream>
+
+/** Choose how many threads evaluate the rules, as the run goes.
+ *
+ * The reads are taken in batches. For each one, the walker reports the time
+ * spent reading it (waiting on decompression), evaluating it, and processing
+ * and writing it (waiting on compression). Every few batches, if evaluation
+ * takes a big share of the time, one more evaluation thread is tried, and if
+ * it takes a small share, one fewer, to leave the cores to the htslib pool
+ * that decompresses and compresses. A change is kept only if the reads per
+ * second go up, and after a while the search starts again, since the cost of
+ * the rules changes along the genome.
+ */
+class ThreadScheduler {
+
+ public:
+
+  /** @param max_threads Most evaluation threads, including the main one */
+  ThreadScheduler(int max_threads = 1) { SetMaxThreads(max_threads); }
+
+  void SetMaxThreads(int max_threads);
+
+  /** Threads to evaluate the next batch on */
+  int Threads() const { return m_threads; }
+
+  /** Add the times of a batch
+   * @param read_s Seconds taken to read the batch
+   * @param eval_s Seconds taken to evaluate it
+   * @param write_s Seconds taken to process and write it
+   * @param reads Reads in the batch
+   */
+  void Record(double read_s, double eval_s, double write_s, size_t reads);
+
+  /** Write the thread counts used on one line */
+  void Report(std::ostream& out) const;
+
+ private:
+
+  // pick the threads for the next window, from the last one
+  void adjust();
+
+  int m_max = 1;
+
+  int m_threads = 1;
+
+  // totals for the current window of batches
+  int m_batches = 0;
+  double m_read_s = 0, m_eval_s = 0, m_write_s = 0;
+  size_t m_reads = 0;
+
+  // the thread count being tried, and what to go back to if it doesn't help
+  bool m_trial = false;
+  int m_prev_threads = 1;
+  double m_prev_rate = 0;
+
+  // windows to wait before the next trial
+  int m_hold = 0;
+
+  size_t m_changes = 0;
+
+  int m_low = 1, m_high = 1;
+
+};
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef VARIANT_VARIANT_BAM_ERROR_H__
+#define VARIANT_VARIANT_BAM_ERROR_H__
+
+#include <stdexcept>
+#include <string>
+
+/** Thrown by the walker (instead of exiting) when a run can't go on, e.g. for
+ * unsorted input that needs sorting, or a failed write */
+class VariantBamError : public std::runtime_error {
+
+ public:
+
+  VariantBamError(const std::string& what) : std::runtime_error(what) {}
+
+};
+
+#endif
@@ -1,5 +1,60 @@
 #include "VariantBamWalker.h"
-#include "htslib/khash.h"
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <functional>
+#include <chrono>
+
+void VariantBamWalker::SetRules(const std::string& json) {
+
+  m_mr = SeqLib::Filter::ReadFilterCollection(json, Header());
+  m_mr.CheckHasIncluder();
+
+}
+
+bool VariantBamWalker::SetThreadPool(SeqLib::ThreadPool p) {
+
+  m_pool = p;
+  return SeqLib::BamReader::SetThreadPool(p);
+
+}
+
+// add the counts of an EmitCounts table to a table of the same rules. Fields
+// that are numbers in both are summed, the others are kept
+static void add_counts(std::string& total, const std::string& add) {
+
+  auto is_count = [](const std::string& f) {
+    return !f.empty() && f.find_first_not_of("0123456789") == std::string::npos;
+  };
+
+  std::istringstream tin(total), ain(add);
+  std::string out, tline, aline;
+  while (std::getline(tin, tline)) {
+    if (!std::getline(ain, aline))
+      aline.clear();
+    std::istringstream tf(tline), af(aline);
+    std::string t, a;
+    bool first = true;
+    while (std::getline(tf, t, '\t')) {
+      if (!std::getline(af, a, '\t'))
+	a.clear();
+      out += (first ? "" : "\t") + (is_count(t) && is_count(a) ? std::to_string(std::stoull(t) + std::stoull(a)) : t);
+      first = false;
+    }
+    out += "\n";
+  }
+  total = out;
+
+}
+
+std::string VariantBamWalker::EmitCounts() const {
+
+  std::string counts = m_mr.EmitCounts();
+  for (const auto& c : m_rule_copies)
+    add_counts(counts, c.EmitCounts());
+  return counts;
+
+}
 
 void VariantBamWalker::writeVariantBam() {
 
@@ -8,39 +63,163 @@ void VariantBamWalker::writeVariantBam() {
   //clock_gettime(CLOCK_MONOTONIC, &start);
 #endif
 
+  // the fast path has no -m window, and doesn't close the split or coverage outputs
+  if (m_unmapped_only && !m_pair_link && m_fragment_rule == FRAGMENT_OFF && max_cov == 0 &&
+      !m_rg_split.IsActive() && !m_input_coverage.IsOpen() && !m_kept_coverage.IsOpen()) {
+    write_unmapped();
+    return;
+  }
+
   SeqLib::BamRecord r;
 
   bool COV_A = true;
   int32_t buffer_size = 10000;
   SeqLib::BamRecordVector buffer;
+  std::vector<uint64_t> route_buffer; // output routes of each buffered read
+  std::vector<char> pass_buffer; // whether each buffered read passed the rules
 
   // check if the BAM is sorted by looking at the header
   std::string hh = Header().AsString(); //std::string(header()->text);
   bool sorted = hh.find("SO:coord") != std::string::npos;
 
-  if (!sorted && max_cov > 0) {
-    std::cerr << "ERROR: BAM file does not appear to be sorted (no SO:coordinate) found in header." << std::endl;
-    std::cerr << "       Sorted BAMs are required for coverage-based rules (max/min coverage)." << std::endl;
-    exit(EXIT_FAILURE);
+  if (!sorted && max_cov > 0)
+    throw VariantBamError("BAM file does not appear to be sorted (no SO:coordinate) found in header.\n"
+			  "       Sorted BAMs are required for coverage-based rules (max/min coverage).");
+
+  if (!sorted && (m_input_coverage.IsOpen() || m_kept_coverage.IsOpen()))
+    throw VariantBamError("Coverage tracks require a BAM sorted by coordinate (SO:coordinate in header)");
+
+  if (sorted && m_fragment_rule != FRAGMENT_OFF)
+    throw VariantBamError("--collated needs input grouped by read name (e.g. samtools collate), but this BAM is sorted by coordinate");
+
+  if (!sorted && (m_checkpoint_every || m_resume))
+    throw VariantBamError("Checkpoints require a BAM sorted by coordinate (SO:coordinate in header)");
+
+  InputPosition cur; // the current read
+  InputPosition flushed; // read at the last write of the -m buffer
+  InputPosition replay; // read at the write before that. Coverage after it is still live
+  InputPosition seek; // when resuming, everything up to here is done
+  bool resuming = m_resume;
+  uint64_t next_checkpoint = m_checkpoint_every;
+
+  if (m_resume) {
+    rc_main = m_checkpoint.rc;
+    m_stats = m_checkpoint.stats;
+    COV_A = m_checkpoint.cov_a;
+    buffer_size = m_checkpoint.buffer_size;
+    replay = m_checkpoint.replay;
+    flushed = m_checkpoint.flushed;
+    next_checkpoint = rc_main.total + m_checkpoint_every;
+
+    // with -m, start early to rebuild the coverage of the live window
+    seek = max_cov != 0 ? m_checkpoint.replay : m_checkpoint.last;
+    if (seek.IsSet())
+      SetMultipleRegions(seek.RemainingRegions(Header()));
   }
 
-  // check that regions are sufficient size
-  for (auto& k : m_region)
-    if (k.Width() < 1000)
-      k.Pad(1000);
+  // check that regions are sufficient size. Coalesced spans are already
+  // planned, and the -k regions of variant are padded before they are merged
+  if (m_requested.empty())
+    for (auto& k : m_region)
+      if (k.Width() < 1000)
+	k.Pad(1000);
+
+  // memory is checked every this many reads, and the -m buffer flushed early if over
+  const uint64_t memory_check_every = 4096;
+  size_t buffer_bytes = 0; // in the -m buffer
+  bool memory_tight = false;
+  m_pair_budget = m_pairs.Budget();
+  m_pair_budget_cut = false;
+  m_rule_bytes = rule_bytes();
+
+  // read the blocks of the next regions while this one is filtered
+  if (m_prefetch_bytes && m_prefetch.Start(m_prefetch_file, m_region, m_prefetch_bytes) && m_verbose)
+    std::cerr << "...reading up to " << (m_prefetch_bytes >> 20) << " MB ahead of the current region" << std::endl;
+
+  // reads skipped before they are evaluated
+  auto skipped = [&](const SeqLib::BamRecord& r) {
+    if (m_dedup_regions && repeated_read(r))
+      return true;
+    if (m_requested.size() && outside_requested(r))
+      return true;
+    // reads that start before the seek point are already done
+    return resuming && seek.IsSet() && r.ChrID() == seek.chr && seek.chr >= 0 && r.Position() < seek.pos;
+  };
+
+  // when resuming, reads already written are only replayed into the -m
+  // coverage. They are taken out while the batch is read, so never evaluated
+  SeqLib::BamRecord last_replayed;
+  auto replayed = [&](const SeqLib::BamRecord& r) {
+    InputPosition at = cur;
+    at.Update(r);
+    const bool seeked = seek.IsSet() && seek.Covers(at);
+    if (!seeked && !m_checkpoint.last.Covers(at)) {
+      resuming = false;
+      return false;
+    }
+    cur = at;
+    last_replayed = r;
+    m_prefetch.Update(r.ChrID(), r.Position(), r.PositionEnd());
+    if (!seeked && max_cov != 0) { // already written, but part of the live coverage
+      // the live window holds the reads since replay, and the other one
+      // those since it was cleared at the last flush
+      COV_A ? cov_a.addRead(r, 0, false) : cov_b.addRead(r, 0, false);
+      if (!flushed.IsSet() || !flushed.Covers(cur))
+	COV_A ? cov_b.addRead(r, 0, false) : cov_a.addRead(r, 0, false);
+    }
+    return true;
+  };
+
+  // with --auto-threads, reads are read and evaluated a batch ahead
+  const size_t batch_size = m_auto_threads ? 4096 : 1;
+  ReadBatch batch;
+  double read_s = 0, eval_s = 0;
+  auto batch_done = std::chrono::steady_clock::now();
+
+  while (!m_sink_done) {
+
+    if (batch.next == batch.reads.size()) {
+      auto t0 = std::chrono::steady_clock::now();
+      if (batch.evaluated)
+	m_scheduler.Record(read_s, eval_s, std::chrono::duration<double>(t0 - batch_done).count(), batch.reads.size());
+
+      batch.reads.clear();
+      batch.next = 0;
+      batch.evaluated = false;
+      SeqLib::BamRecord q;
+      while (batch.reads.size() < batch_size && GetNextRecord(q))
+	if (!skipped(q) && !(resuming && replayed(q)))
+	  batch.reads.push_back(q);
+      if (batch.reads.empty())
+	break;
+
+      auto t1 = std::chrono::steady_clock::now();
+      if (batch_size > 1)
+	evaluate_batch(batch, m_scheduler.Threads());
+      batch_done = std::chrono::steady_clock::now();
+      read_s = std::chrono::duration<double>(t1 - t0).count();
+      eval_s = std::chrono::duration<double>(batch_done - t1).count();
+    }
+
+    const size_t bi = batch.next++;
+    r = batch.reads[bi];
 
-  while (GetNextRecord(r)) {
+    cur.Update(r);
+    m_prefetch.Update(r.ChrID(), r.Position(), r.PositionEnd());
 
-    int s, e;
-    if (phred  > 0) {
-      std::string seq = r.Sequence();
-      r.QualityTrimmedSequence(phred, s, e);
-      int new_len = e - s;
-      if (e != -1 && new_len < r.Length() && new_len > 0 && new_len - s >= 0 && s + new_len <= r.Length())
-	r.AddZTag("GV", seq.substr(s, new_len));
+    uint64_t routes = 0;
+    bool rule;
+    if (batch.evaluated) {
+      rule = batch.pass[bi];
+      routes = batch.routes[bi];
+    } else {
+      int32_t s, e;
+      if (phred  > 0 && QualityTrimBounds(r.raw(), phred, s, e))
+	AddTrimmedSequenceTag(r.raw(), s, e);
+      rule = evaluate(r, routes);
     }
 
-    bool rule = m_mr.isValid(r);
+    m_input_coverage.AddRead(r.raw());
     
     // prepare for case of long reads
     buffer_size = std::max((int32_t)r.Length() * 5, buffer_size);
@@ -52,14 +231,26 @@ void VariantBamWalker::writeVariantBam() {
       cov_a.addRead(r, 0, false);
       cov_b.addRead(r, 0, false);
     }
+
+    if (rc_main.total % memory_check_every == 0)
+      memory_tight = check_memory(buffer_bytes);
     
-    // read is valid
-    if (rule) {
+    const uint16_t flag = r.raw()->core.flag;
+    if (m_fragment_rule != FRAGMENT_OFF) {
+      add_to_fragment(r, rule, routes); // decided once the whole fragment is read
+    } else if (m_pair_link && (flag & BAM_FPAIRED) && !(flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY))) {
+      link_pair(r, rule, routes); // decided once the mate is seen
+    } else if (rule || (max_cov != 0 && is_writing() && (m_rejected_writer.IsOpen() || m_mark_qc_fail))) {
+      // a valid read, or with -m, a failed one that is written. Failed reads
+      // wait in the buffer with the valid ones, so both outputs stay sorted
       
-      if (max_cov == 0 && m_writer.IsOpen()) { // if we specified an output file, write it
-	write_record(r);
-      } else if (m_writer.IsOpen()) {
+      if (max_cov == 0 || !is_writing()) { // write it now, or just count it if no output
+	keep_record(r, routes);
+      } else {
 	buffer.push_back(r);
+	route_buffer.push_back(routes);
+	pass_buffer.push_back(rule);
+	buffer_bytes += sizeof(bam1_t) + r.raw()->m_data;
 	
 	// clear buffer
 	// pass back and forth between cov_a and cov_b.
@@ -67,58 +258,359 @@ void VariantBamWalker::writeVariantBam() {
 	  
 	  // error if BAM not sorted
 	  if (buffer[0].Position() - buffer.back().Position() > 0 && buffer[0].ChrID() == buffer.back().ChrID()) {
-	    std::cerr << "ERROR: BAM file is not sorted. " << std::endl;
-	    std::cerr << " ------ Found read:  " << buffer[0] << std::endl;
-	    std::cerr << " ------ before read: " << buffer.back() << std::endl;
-	    std::cerr << " ------ BAM must be sorted if using the -m flag for max coverage. Exiting" << std::endl;
-	    exit(EXIT_FAILURE);
+	    std::stringstream ss;
+	    ss << "BAM file is not sorted. " << std::endl
+	       << " ------ Found read:  " << buffer[0] << std::endl
+	       << " ------ before read: " << buffer.back() << std::endl
+	       << " ------ BAM must be sorted if using the -m flag for max coverage. Exiting";
+	    throw VariantBamError(ss.str());
 	  }
 	  
-	  if ( (buffer.back().Position() - buffer[0].Position() > buffer_size) || buffer.back().ChrID() != buffer[0].ChrID()) {
-	    COV_A ? subSampleWrite(buffer, cov_a) : subSampleWrite(buffer, cov_b);
+	  // over the memory budget, flush the window early rather than let it grow
+	  if ( (buffer.back().Position() - buffer[0].Position() > buffer_size) || buffer.back().ChrID() != buffer[0].ChrID() ||
+	       memory_tight) {
+	    COV_A ? subSampleWrite(buffer, cov_a, route_buffer, pass_buffer) : subSampleWrite(buffer, cov_b, route_buffer, pass_buffer);
 	    COV_A ? cov_a.clear() : cov_b.clear();
 	    COV_A = !COV_A;
 	    buffer.clear();
+	    route_buffer.clear();
+	    pass_buffer.clear();
+	    buffer_bytes = 0;
+	    memory_tight = false;
+	    replay = flushed;
+	    flushed = cur;
 	  }
 	}
-      } else if (!m_writer.IsOpen()) { // we are not outputting anything
-	++rc_main.keep;
       }
       
-    } else if (m_mark_qc_fail) { // fails, but we should mark it and write
-      r.SetQCFail(true);
-      write_record(r);
+    } else { // fails, but we may need to mark it or send it to the rejected output
+      reject_record(r);
     }
     
     
     if (++rc_main.total % 1000000 == 0 && m_verbose)
       printMessage(r);
+
+    update_metrics(r, buffer.size());
+
+    // only checkpoint when nothing is waiting in the -m buffer
+    if (m_checkpoint_every && rc_main.total >= next_checkpoint && buffer.empty()) {
+      write_checkpoint(cur, replay, flushed, COV_A, buffer_size);
+      next_checkpoint = rc_main.total + m_checkpoint_every;
+    }
   }
 
   // clear last buffer
   if (buffer.size()) {
-    COV_A ? subSampleWrite(buffer, cov_a) : subSampleWrite(buffer, cov_b);
+    COV_A ? subSampleWrite(buffer, cov_a, route_buffer, pass_buffer) : subSampleWrite(buffer, cov_b, route_buffer, pass_buffer);
     COV_A ? cov_a.clear() : cov_b.clear();
     COV_A = !COV_A;
     buffer.clear();
+    route_buffer.clear();
+    pass_buffer.clear();
   }
-  
+
+  m_prefetch.Stop();
+
+  if (m_pair_link)
+    finish_pairs();
+  if (m_fragment_rule != FRAGMENT_OFF)
+    flush_fragment();
+
+  m_input_coverage.Close();
+  m_kept_coverage.Close();
+  m_rg_split.Close();
+  m_renamer.Close();
+
+  if (r.isEmpty())
+    r = last_replayed;
   if (r.isEmpty()) {
     std::cerr << "NO READS RETRIEVED FROM THESE REGIONS" << std::endl;
     return;
   }
 
-  if (m_verbose)
+  if (m_verbose) {
     printMessage(r);
+    for (auto& o : m_routes)
+      std::cerr << "...output " << o.name << " kept " << o.rc.keepString() << std::endl;
+    if (m_rg_split.IsActive())
+      std::cerr << "...split into " << m_rg_split.NumGroups() << " read groups, reopening files " << m_rg_split.NumReopens() << " times" << std::endl;
+    if (m_auto_threads)
+      m_scheduler.Report(std::cerr);
+    m_memory.Report(std::cerr);
+  }
+
+}
+
+void VariantBamWalker::write_unmapped() {
+
+  // unmapped reads have no position, so there is no coverage to sample on
+  // and no region to look up. Reads are taken in batches, so that the
+  // rules can be evaluated on several threads
+  const size_t batch_size = 4096;
+
+  ReadBatch batch;
+  SeqLib::BamRecord r, last;
+  bool more = true;
+
+  while (more && !m_sink_done) {
+
+    auto t0 = std::chrono::steady_clock::now();
+    batch.reads.clear();
+    while (batch.reads.size() < batch_size && (more = GetNextRecord(r)))
+      batch.reads.push_back(r);
+
+    auto t1 = std::chrono::steady_clock::now();
+    evaluate_batch(batch, m_auto_threads ? m_scheduler.Threads() : m_eval_threads);
+    auto t2 = std::chrono::steady_clock::now();
+
+    // write in input order
+    for (size_t i = 0; i < batch.reads.size(); ++i) {
+
+      if (m_track_stats)
+	TrackSeenRead(batch.reads[i]);
+
+      if (batch.pass[i])
+	keep_record(batch.reads[i], batch.routes[i]);
+      else
+	reject_record(batch.reads[i]);
+
+      if (++rc_main.total % 1000000 == 0 && m_verbose)
+	printMessage(batch.reads[i]);
+
+      update_metrics(batch.reads[i], 0);
+    }
+
+    if (m_auto_threads)
+      m_scheduler.Record(std::chrono::duration<double>(t1 - t0).count(), std::chrono::duration<double>(t2 - t1).count(),
+			 std::chrono::duration<double>(std::chrono::steady_clock::now() - t2).count(), batch.reads.size());
+
+    if (!batch.reads.empty())
+      last = batch.reads.back();
+  }
+
+  m_renamer.Close();
+
+  if (!rc_main.total) {
+    std::cerr << "NO READS RETRIEVED FROM THESE REGIONS" << std::endl;
+    return;
+  }
+
+  if (m_verbose) {
+    printMessage(last);
+    for (auto& o : m_routes)
+      std::cerr << "...output " << o.name << " kept " << o.rc.keepString() << std::endl;
+    if (m_auto_threads)
+      m_scheduler.Report(std::cerr);
+  }
+
+}
+
+// run one evaluate_batch job on a pool thread
+static void* run_eval_job(void* arg) {
+  (*static_cast<std::function<void()>*>(arg))();
+  return nullptr;
+}
+
+void VariantBamWalker::evaluate_batch(ReadBatch& b, int nthreads) {
+
+  const size_t n = b.reads.size();
+  b.routes.assign(n, 0);
+  b.pass.assign(n, 0);
+  b.next = 0;
+  b.evaluated = true;
+
+  // the extra threads are jobs on the pool, each with its own rules
+  if (!m_routes.empty() || !m_pool.IsOpen() || !m_build_rules)
+    nthreads = 1;
+  nthreads = std::max(1, nthreads);
+  if (nthreads > 1 && !m_eval_queue)
+    m_eval_queue.reset(hts_tpool_process_init(m_pool.tp->pool, 2 * m_eval_threads, 1));
+  if (!m_eval_queue)
+    nthreads = 1;
+  while (m_rule_copies.size() < (size_t)nthreads - 1)
+    m_rule_copies.push_back(m_build_rules());
+
+  // evaluate reads [s, e) of the batch
+  auto eval = [&](SeqLib::Filter::ReadFilterCollection* mr, size_t s, size_t e) {
+    for (size_t i = s; i < e; ++i) {
+      int32_t ts, te;
+      if (phred > 0 && QualityTrimBounds(b.reads[i].raw(), phred, ts, te))
+	AddTrimmedSequenceTag(b.reads[i].raw(), ts, te);
+      b.pass[i] = mr ? mr->isValid(b.reads[i]) : evaluate(b.reads[i], b.routes[i]);
+    }
+  };
+
+  if (nthreads == 1 || n < (size_t)nthreads) {
+    if (m_metrics)
+      m_metrics->eval_jobs.store(0, std::memory_order_relaxed);
+    eval(nullptr, 0, n);
+    return;
+  }
+
+  // this thread takes the first chunk, and waits for the pool to do the rest
+  size_t chunk = (n + nthreads - 1) / nthreads;
+  std::vector<std::function<void()>> jobs;
+  jobs.reserve(nthreads - 1);
+  for (int i = 1; i < nthreads; ++i) {
+    SeqLib::Filter::ReadFilterCollection* mr = &m_rule_copies[i - 1];
+    size_t s = std::min(n, i * chunk), e = std::min(n, (i + 1) * chunk);
+    jobs.push_back([&eval, mr, s, e]() { eval(mr, s, e); });
+    if (hts_tpool_dispatch(m_pool.tp->pool, m_eval_queue.get(), run_eval_job, &jobs.back()) < 0)
+      jobs.back()();
+  }
+  if (m_metrics)
+    m_metrics->eval_jobs.store(hts_tpool_process_len(m_eval_queue.get()), std::memory_order_relaxed);
+  eval(&m_mr, 0, chunk);
+  hts_tpool_process_flush(m_eval_queue.get());
+
+}
+
+void VariantBamWalker::link_pair(SeqLib::BamRecord& r, bool pass, uint64_t routes) {
+
+  PendingRead mate;
+  if (!m_pairs.Add(r, pass, routes, mate))
+    return;
+
+  // either mate passing keeps both, on every route that either passed
+  pass = pass || mate.pass;
+  routes |= mate.routes;
+  bool swap = m_fastq && (mate.r.raw()->core.flag & BAM_FREAD2);
+  for (SeqLib::BamRecord* p : {swap ? &r : &mate.r, swap ? &mate.r : &r})
+    pass ? keep_record(*p, routes) : reject_record(*p);
+
+}
+
+// FASTQ pairs are written first read, then second
+static void first_read_first(std::vector<PendingRead>& group) {
+
+  std::stable_partition(group.begin(), group.end(), [](const PendingRead& p) {
+      return !(p.r.raw()->core.flag & BAM_FREAD2);
+    });
+
+}
+
+void VariantBamWalker::finish_pairs() {
+
+  // pairs split across spilled runs, and reads whose mate never came
+  std::vector<PendingRead> group;
+  while (m_pairs.NextGroup(group)) {
+    bool pass = false;
+    uint64_t routes = 0;
+    for (const auto& p : group) {
+      pass = pass || p.pass;
+      routes |= p.routes;
+    }
+    if (m_fastq)
+      first_read_first(group);
+    for (auto& p : group)
+      pass ? keep_record(p.r, routes) : reject_record(p.r);
+  }
+
+  if (m_verbose && m_pairs.NumSpills())
+    std::cerr << "...pair table was spilled to disk " << m_pairs.NumSpills() << " times" << std::endl;
+
+}
+
+void VariantBamWalker::add_to_fragment(SeqLib::BamRecord& r, bool pass, uint64_t routes) {
+
+  if (m_fragment.size() && strcmp(bam_get_qname(m_fragment[0].r.raw()), bam_get_qname(r.raw())) != 0)
+    flush_fragment();
+
+  m_fragment.push_back(PendingRead());
+  m_fragment.back().r = r;
+  m_fragment.back().pass = pass;
+  m_fragment.back().routes = routes;
 
 }
 
-void VariantBamWalker::subSampleWrite(SeqLib::BamRecordVector& buff, const STCoverage& cov) {
+void VariantBamWalker::flush_fragment() {
+
+  // "any" keeps the fragment on every route that one of its reads passed,
+  // "all" only on the routes that every read passed
+  bool any = false, all = true;
+  uint64_t any_routes = 0, all_routes = ~0ULL;
+  for (const auto& p : m_fragment) {
+    any = any || p.pass;
+    all = all && p.pass;
+    any_routes |= p.routes;
+    all_routes &= p.routes;
+  }
+
+  bool pass = m_fragment_rule == FRAGMENT_ALL ? all && (m_routes.empty() || all_routes) : any;
+  uint64_t routes = m_fragment_rule == FRAGMENT_ALL ? all_routes : any_routes;
+  if (m_fastq)
+    first_read_first(m_fragment);
+  for (auto& p : m_fragment)
+    pass ? keep_record(p.r, routes) : reject_record(p.r);
+
+  m_fragment.clear();
+
+}
 
-  for (auto& r : buff)
+bool VariantBamWalker::check_memory(size_t buffer_bytes) {
+
+  size_t fragment = 0;
+  for (const auto& p : m_fragment)
+    fragment += sizeof(PendingRead) + p.r.raw()->m_data;
+
+  m_memory.Set(MemoryBudget::COVERAGE, cov_a.MemoryUsage() + cov_b.MemoryUsage());
+  m_memory.Set(MemoryBudget::READ_BUFFER, buffer_bytes);
+  m_memory.Set(MemoryBudget::PAIRS, m_pairs.MemoryUsage());
+  m_memory.Set(MemoryBudget::FRAGMENT, fragment);
+  m_memory.Set(MemoryBudget::STATS, m_stats.MemoryUsage());
+  m_memory.Set(MemoryBudget::REGIONS, (m_region.size() + m_requested.size()) * sizeof(SeqLib::GenomicRegion));
+  m_memory.Set(MemoryBudget::RULES, m_rule_bytes * (1 + m_rule_copies.size()));
+
+  // the pair table spills to disk on its own, once it reaches its budget.
+  // Cut that once, the first time the run is over, to what the others leave
+  // it. PairLinker keeps a floor, so a tight limit doesn't spill every few reads
+  if (m_pair_link && !m_pair_budget_cut && m_memory.Over()) {
+    m_pairs.SetBudget(std::min(m_pair_budget, m_memory.Available(MemoryBudget::PAIRS)));
+    m_pair_budget_cut = true;
+  }
+
+  return m_memory.Over();
+}
+
+// rough bytes of an interval tree node holding one rule region
+static const size_t RULE_REGION_BYTES = sizeof(SeqLib::GenomicRegion) + 64;
+
+size_t VariantBamWalker::rule_bytes() const {
+
+  size_t n = m_mr.getAllRegions().size();
+  for (const auto& o : m_routes)
+    n += o.rfc.getAllRegions().size();
+  return n * RULE_REGION_BYTES;
+}
+
+void VariantBamWalker::update_metrics(const SeqLib::BamRecord& r, size_t buffered) {
+
+  if (!m_metrics)
+    return;
+
+  m_metrics->reads.store(rc_main.total, std::memory_order_relaxed);
+  m_metrics->kept.store(rc_main.keep, std::memory_order_relaxed);
+  m_metrics->chr.store(r.ChrID(), std::memory_order_relaxed);
+  m_metrics->pos.store(r.Position(), std::memory_order_relaxed);
+  m_metrics->bytes_in.fetch_add(r.raw()->l_data + 36, std::memory_order_relaxed); // 4 byte size + 32 byte core
+  m_metrics->buffered.store(buffered, std::memory_order_relaxed);
+
+}
+
+void VariantBamWalker::subSampleWrite(SeqLib::BamRecordVector& buff, const STCoverage& cov, const std::vector<uint64_t>& routes,
+				      const std::vector<char>& pass) {
+
+  for (size_t i = 0; i < buff.size(); ++i)
     {
+      SeqLib::BamRecord& r = buff[i];
+      if (!pass[i]) { // failed the rules, and only waited to keep the output sorted
+	reject_record(r);
+	continue;
+      }
       double this_cov1 = cov.getCoverageAtPosition(r.ChrID(), r.Position());
-      double this_cov2 = cov.getCoverageAtPosition(r.ChrID(), r.PositionEnd());
+      // the coverage counts [pos, end), so the last base of the read is end - 1
+      double this_cov2 = cov.getCoverageAtPosition(r.ChrID(), std::max(r.Position(), r.PositionEnd() - 1));
       //double this_cov3 = cov.getCoverageAtPosition(r.ChrID(), r.Position());
       //double this_cov4 = cov.getCoverageAtPosition(r.ChrID(), r.PositionEnd());
       double this_cov = std::max(this_cov1, this_cov2);
@@ -129,24 +621,19 @@ void VariantBamWalker::subSampleWrite(SeqLib::BamRecordVector& buff, const STCov
       // this read should be randomly sampled, cov is too high
       if (this_cov > max_cov && max_cov > 0) 
 	{
-	  uint32_t k = __ac_Wang_hash(__ac_X31_hash_string(r.Qname().c_str()) ^ m_seed);
+	  uint32_t k = QnameHash(bam_get_qname(r.raw()), m_seed);
 	  if ((double)(k&0xffffff) / 0x1000000 <= sample_rate) { // passed the random filter
-	    write_record(r);
-	  } else if (m_mark_qc_fail) {
-	    r.SetQCFail(true);
-	    write_record(r);
+	    keep_record(r, routes[i]);
+	  } else {
+	    reject_record(r);
 	  }
 	}
       // only take if reaches minimum coverage
       else if (this_cov < -max_cov) { // max_cov = -10 
-	if (m_mark_qc_fail) {
-	  r.SetQCFail(true);
-          write_record(r);
-	} else {
-	  //std::cerr << "not writing because this cov is " << this_cov << " and min cov is " << (-max_cov) << std::endl;
-	}
+	//std::cerr << "not writing because this cov is " << this_cov << " and min cov is " << (-max_cov) << std::endl;
+	reject_record(r);
       } else {
-        write_record(r);
+        keep_record(r, routes[i]);
       }
       
     }
@@ -188,23 +675,234 @@ void VariantBamWalker::printMessage(const SeqLib::BamRecord &r) const
   std::cerr << std::string(buffer) << std::endl;
 }
 
-void VariantBamWalker::write_record(SeqLib::BamRecord& r) {
+bool VariantBamWalker::evaluate(SeqLib::BamRecord& r, uint64_t& routes) {
+
+  if (m_routes.empty())
+    return m_mr.isValid(r);
+
+  // each route is evaluated on its own, so one read can go to many outputs
+  routes = 0;
+  for (size_t i = 0; i < m_routes.size(); ++i)
+    if (m_routes[i].rfc.isValid(r))
+      routes |= (1ULL << i);
+
+  return routes != 0;
+}
+
+bool VariantBamWalker::is_writing() const {
+
+  if (m_writer.IsOpen() || m_rg_split.IsActive() || m_sink)
+    return true;
+
+  for (const auto& o : m_routes)
+    if (o.writer.IsOpen())
+      return true;
+
+  return false;
+}
+
+void VariantBamWalker::reject_record(SeqLib::BamRecord& r) {
 
+  // rejected output takes precedence over QC fail marking
+  if (m_rejected_writer.IsOpen()) {
+    write_to(m_rejected_writer, r);
+  } else if (m_mark_qc_fail) {
+    r.SetQCFail(true);
+    write_record(r, 0);
+  }
+
+}
+
+bool VariantBamWalker::repeated_read(const SeqLib::BamRecord& r) {
+
+  if (r.ChrID() < 0)
+    return false;
+
+  // reads come back sorted within a region, so going backwards means a new
+  // region is re-reading the overlap with the last one
+  if (r.ChrID() < m_dedup_chr || (r.ChrID() == m_dedup_chr && r.Position() < m_dedup_pos))
+    return true;
+
+  std::string key = r.Qname() + "\t" + std::to_string(r.raw()->core.flag);
+
+  if (r.ChrID() != m_dedup_chr || r.Position() != m_dedup_pos) {
+    m_dedup_chr = r.ChrID();
+    m_dedup_pos = r.Position();
+    m_dedup_reads.clear();
+  } else if (std::find(m_dedup_reads.begin(), m_dedup_reads.end(), key) != m_dedup_reads.end()) {
+    return true;
+  }
+
+  m_dedup_reads.push_back(key);
+  return false;
+}
+
+void VariantBamWalker::SampleRegion(const SeqLib::GenomicRegion& g, size_t max_reads, EstimateSample& s) {
+
+  if (!SetRegion(g))
+    return;
+
+  SeqLib::BamRecord r;
+  size_t n = 0;
+  uint64_t kept = 0, kept_bytes = 0, kept_bases = 0;
+  int32_t first = -1, last = -1;
+  std::chrono::steady_clock::time_point start;
+  
+  while (n < max_reads && GetNextRecord(r)) {
+
+    // reads from before the window are sampled by the window they start in
+    if (g.chr >= 0 && r.Position() < g.pos1 - 1)
+      continue;
+
+    // the seek to the window isn't part of the time per read
+    if (n == 0)
+      start = std::chrono::steady_clock::now();
+    ++n;
+
+    uint64_t bytes = 4 + sizeof(bam1_core_t) + r.raw()->l_data;
+    s.bytes += bytes;
+
+    uint64_t routes = 0;
+    if (evaluate(r, routes)) {
+      ++kept;
+      kept_bytes += bytes;
+      kept_bases += std::max(r.PositionEnd() - r.Position(), 0);
+      if (first < 0)
+	first = r.Position();
+      last = std::max(last, r.PositionEnd());
+    }
+  }
+
+  if (n > 1) {
+    s.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    s.timed_reads += n - 1;
+  }
+  s.reads += n;
+
+  // -m keeps about max_cov / depth of the reads where the kept depth is higher
+  double frac = 1;
+  if (max_cov > 0 && g.chr >= 0 && last > first) {
+    double depth = (double)kept_bases / (last - first);
+    if (depth > max_cov)
+      frac = max_cov / depth;
+  }
+  s.kept += kept * frac;
+  s.kept_bytes += kept_bytes * frac;
+
+}
+
+bool VariantBamWalker::outside_requested(const SeqLib::BamRecord& r) {
+
+  // reads are sorted, so a region that ends before this read starts is done
+  const int32_t chr = r.ChrID(), pos = r.Position();
+  while (m_requested_next < m_requested.size() &&
+	 (m_requested[m_requested_next].chr < chr ||
+	  (m_requested[m_requested_next].chr == chr && m_requested[m_requested_next].pos2 <= pos)))
+    ++m_requested_next;
+
+  if (m_requested_next == m_requested.size())
+    return true;
+
+  const SeqLib::GenomicRegion& g = m_requested[m_requested_next];
+  return g.chr != chr || r.PositionEnd() < g.pos1;
+}
+
+void VariantBamWalker::keep_record(SeqLib::BamRecord& r, uint64_t routes) {
+
+  m_kept_coverage.AddRead(r.raw());
+
+  if (is_writing())
+    write_record(r, routes);
+  else
+    ++rc_main.keep;
+
+}
+
+void VariantBamWalker::write_record(SeqLib::BamRecord& r, uint64_t routes) {
+
+  // FASTQ keeps the qualities, so is trimmed as it is written
+  int32_t s = 0, e = r.raw()->core.l_qseq;
   if (m_write_trimmed) {
-    r.SetSequence(r.QualitySequence());
-    r.SetQualities(std::string(), 0);
+    if (phred > 0)
+      QualityTrimBounds(r.raw(), phred, s, e);
+    if (!m_fastq) {
+      TrimRecord(r.raw(), s, e, m_cigar_scratch);
+      s = 0;
+      e = r.raw()->core.l_qseq;
+    }
   }
 
+  // the read group comes from the RG tag or the read name, so look it up
+  // before the tags are stripped and the read is renamed
+  std::string rg;
+  if (m_rg_split.IsActive() && !m_sink)
+    rg = BamStats::ReadGroup(r);
+
   // strip tags
   if (m_strip_all_tags)
     r.RemoveAllTags();
-  else if (m_tags_to_strip.size()) {
-    for (const auto& i : m_tags_to_strip)
-      r.RemoveTag(i.c_str());
-  }
+  else if (m_tag_filter.IsActive())
+    m_tag_filter.Apply(r.raw());
+
+  // after -Z, which trims on the full qualities
+  if (m_qual_bins.IsActive())
+    m_qual_bins.Apply(r.raw());
+
+  if (m_renamer.IsActive())
+    m_renamer.Apply(r.raw());
 
   // write it
-  m_writer.WriteRecord(r);
+  if (m_sink) {
+    m_sink_done = m_sink_done || !m_sink->Write(r.raw());
+  } else if (m_rg_split.IsActive()) {
+    write_to(m_rg_split.Writer(rg), r, s, e);
+  } else if (m_routes.empty()) {
+    write_to(m_writer, r, s, e);
+  } else {
+    for (size_t i = 0; i < m_routes.size(); ++i)
+      if (routes & (1ULL << i)) {
+	write_to(m_routes[i].writer, r, s, e);
+	++m_routes[i].rc.keep;
+      }
+  }
 
   ++rc_main.keep;
 }
+
+void VariantBamWalker::write_checkpoint(const InputPosition& last, const InputPosition& replay, const InputPosition& flushed,
+					bool cov_a_live, int32_t buffer_size) {
+
+  Checkpoint ck;
+  ck.input = m_checkpoint.input;
+  ck.output = m_checkpoint.output;
+  ck.last = last;
+  ck.replay = replay;
+  ck.flushed = flushed;
+  ck.cov_a = cov_a_live;
+  ck.buffer_size = buffer_size;
+  ck.rc = rc_main;
+  ck.stats = m_stats;
+
+  // everything written so far has to be on disk before the checkpoint is
+  ck.out_offset = m_writer.Flush();
+  if (ck.out_offset < 0)
+    throw VariantBamError("could not flush " + m_writer.FileName() + " for checkpoint");
+
+  if (!ck.Write(m_checkpoint_file))
+    throw VariantBamError("could not write checkpoint " + m_checkpoint_file);
+
+  if (m_verbose)
+    std::cerr << "...checkpoint at read " << rc_main.totalString() << std::endl;
+
+}
+
+void VariantBamWalker::write_to(OutputWriter& w, const SeqLib::BamRecord& r, int32_t start, int32_t end) {
+
+  if (!w.WriteRecord(r, start, end))
+    throw VariantBamError("failed to write read " + r.Qname() + " to " + w.FileName() + "\n"
+			  "       If building the index while writing, the output must be sorted by coordinate");
+
+  if (m_metrics)
+    m_metrics->bytes_out.fetch_add(r.raw()->l_data + 36, std::memory_order_relaxed);
+
+}
@@ -1,29 +1,101 @@
 #ifndef VARIANT_VARIANT_BAM_WALKER_H__
 #define VARIANT_VARIANT_BAM_WALKER_H__
 
+#include <functional>
+#include <memory>
+
 #include "SeqLib/BamReader.h"
-#include "SeqLib/BamWriter.h"
 #include "SeqLib/ReadFilter.h"
+#include "htslib/thread_pool.h"
 #include "BamStats.h"
+#include "OutputWriter.h"
+#include "Checkpoint.h"
+#include "MetricsEmitter.h"
+#include "TagFilter.h"
+#include "QualityBinner.h"
+#include "QnameRenamer.h"
+#include "QualityTrim.h"
+#include "CoverageTrack.h"
+#include "PairLinker.h"
+#include "RegionPrefetcher.h"
+#include "MemoryBudget.h"
+#include "ReadGroupSplitter.h"
+#include "RecordSink.h"
+#include "VariantBamError.h"
+#include "ThreadScheduler.h"
 //#include "SnowTools/BamRead.h"
 #include "STCoverage.h"
 
+/** One output of a multi-output run.
+ *
+ * Each route holds the rules of a single top-level group of the JSON
+ * script, and receives every read that passes that group.
+ */
+struct OutputRoute {
+
+  std::string name; // name of the rule group
+
+  SeqLib::Filter::ReadFilterCollection rfc;
+
+  OutputWriter writer;
+
+  ReadCount rc;
+
+};
+
+/** Tallies of the reads sampled by --estimate */
+struct EstimateSample {
+
+  uint64_t reads = 0;
+
+  uint64_t bytes = 0; // uncompressed BAM records
+
+  double kept = 0; // after -m, if set
+
+  double kept_bytes = 0;
+
+  // time to decode and filter the reads after the first of each window
+  uint64_t timed_reads = 0;
+  double seconds = 0;
+
+};
+
 class VariantBamWalker: public SeqLib::BamReader
 {
  public:
 
    VariantBamWalker() {}
 
+  /** Filter the reads, writing the kept ones to the outputs (or the sink).
+   * Throws VariantBamError if the run can't go on */
   void writeVariantBam();
+
+  /** Set the rules from a JSON script, as for -r */
+  void SetRules(const std::string& json);
+
+  /** Set the htslib pool, which also evaluates the rules for --auto-threads and -k UN */
+  bool SetThreadPool(SeqLib::ThreadPool p);
+
+  /** Return the rule counts of m_mr plus those of the copies on the other
+   * evaluation threads, in the layout of ReadFilterCollection::EmitCounts */
+  std::string EmitCounts() const;
   
   void TrackSeenRead(SeqLib::BamRecord &r);
   
   void printMessage(const SeqLib::BamRecord &r) const;
+
+  /** Run the rules (and -m) on the reads that start in a region, for --estimate
+   * @param g Region to sample. Reads that start before it are skipped
+   * @param max_reads Stop after this many reads
+   * @param s Tallies to add to
+   */
+  void SampleRegion(const SeqLib::GenomicRegion& g, size_t max_reads, EstimateSample& s);
   
   BamStats m_stats;
 
   bool m_write_trimmed = false; // output the phred trimmed instead of orig sequence
   bool m_mark_qc_fail = false; // set as QC failed instead of deletingz
+  bool m_fastq = false; // FASTQ output: -Z keeps the qualities, and the first read of a pair goes first
   
   STCoverage cov_a;
   STCoverage cov_b;
@@ -32,7 +104,8 @@ class VariantBamWalker: public SeqLib::BamReader
   
   int max_cov = 0;
 
-  void subSampleWrite(SeqLib::BamRecordVector& buff, const STCoverage& cov);
+  void subSampleWrite(SeqLib::BamRecordVector& buff, const STCoverage& cov, const std::vector<uint64_t>& routes,
+		      const std::vector<char>& pass);
 
   int phred = -1;
 
@@ -42,15 +115,199 @@ class VariantBamWalker: public SeqLib::BamReader
   
   SeqLib::Filter::ReadFilterCollection m_mr;
 
-  SeqLib::BamWriter m_writer;
+  OutputWriter m_writer;
 
   bool m_strip_all_tags = false;
 
-  std::vector<std::string> m_tags_to_strip;
+  // tags to strip (-s), or to keep (--keep-tags)
+  TagFilter m_tag_filter;
+
+  // base quality bins for the written reads (--bin-qualities)
+  QualityBinner m_qual_bins;
+
+  // short, hashed read names for the written reads (--rename-reads)
+  QnameRenamer m_renamer;
+
+  // outputs for multi-output runs. If empty, everything goes to m_writer
+  std::vector<OutputRoute> m_routes;
+
+  // optional sink for reads that don't pass any rule
+  OutputWriter m_rejected_writer;
+
+  // one output per read group, instead of m_writer
+  ReadGroupSplitter m_rg_split;
+
+  // takes the kept reads in memory, instead of any of the outputs. Not owned
+  RecordSink* m_sink = nullptr;
+
+  // write a checkpoint after (about) this many reads. 0 is off
+  uint64_t m_checkpoint_every = 0;
+
+  std::string m_checkpoint_file;
+
+  // resume from m_checkpoint, rather than starting at the beginning
+  bool m_resume = false;
+
+  // checkpoint to resume from. Also holds the input / output names for new checkpoints
+  Checkpoint m_checkpoint;
+
+  // live counters for a MetricsEmitter. Not updated if NULL
+  RunMetrics* m_metrics = nullptr;
+
+  // the regions are sorted, but may touch or overlap, so drop reads that an
+  // earlier region already returned
+  bool m_dedup_regions = false;
+
+  // the regions asked for, if the walker regions are coalesced spans of
+  // them. Reads that don't overlap one are skipped
+  std::vector<SeqLib::GenomicRegion> m_requested;
+
+  // memory of the coverage maps, buffers and stats, and the limit on it (--max-memory)
+  MemoryBudget m_memory;
+
+  // bytes of the next regions to read ahead of the current one. 0 is off
+  size_t m_prefetch_bytes = 0;
+
+  // input file, for the read-ahead
+  std::string m_prefetch_file;
+
+  // optional bedGraph tracks of the depth of every input read, and of the kept reads
+  CoverageTrack m_input_coverage;
+  CoverageTrack m_kept_coverage;
+
+  // the only region is the unmapped reads (-k UN), so take the fast path
+  bool m_unmapped_only = false;
+
+  // threads to evaluate the rules on, for the unmapped fast path: this one
+  // plus jobs on the htslib pool, so it is at most 1 + the pool's threads
+  int m_eval_threads = 1;
+
+  // build a fresh copy of the rules for each extra evaluation thread. A copy
+  // of m_mr shares its region trees and motif tries, and the motif trie
+  // finishes building itself on its first search, so they can't be shared.
+  // Unset, the rules are evaluated on one thread
+  std::function<SeqLib::Filter::ReadFilterCollection()> m_build_rules;
+
+  // evaluate the rules on batches of reads, on as many of m_eval_threads
+  // as m_scheduler finds pays off, leaving the rest to the thread pool
+  bool m_auto_threads = false;
+  ThreadScheduler m_scheduler;
+
+  // collect m_stats. The unmapped fast path skips them if not needed
+  bool m_track_stats = true;
+
+  // keep (or reject) both mates of a pair together, if either passes
+  bool m_pair_link = false;
+
+  // mates waiting for each other, for m_pair_link
+  PairLinker m_pairs;
+
+  // input is grouped by QNAME (e.g. samtools collate), and the rules are
+  // applied to each fragment as a whole
+  enum FragmentRule { FRAGMENT_OFF, FRAGMENT_ANY, FRAGMENT_ALL };
+  FragmentRule m_fragment_rule = FRAGMENT_OFF;
 
  private:
 
-  void write_record(SeqLib::BamRecord& r);
+  // filter the unmapped reads, with no region or coverage bookkeeping
+  void write_unmapped();
+
+  // hold a paired read until its mate arrives, then keep or reject both
+  void link_pair(SeqLib::BamRecord& r, bool pass, uint64_t routes);
+
+  // keep or reject the pairs still waiting at the end of the input
+  void finish_pairs();
+
+  // alignments of the current fragment, for m_fragment_rule
+  std::vector<PendingRead> m_fragment;
+
+  // add a read to the fragment, writing out the last one if this is a new QNAME
+  void add_to_fragment(SeqLib::BamRecord& r, bool pass, uint64_t routes);
+
+  // keep or reject the whole of the current fragment
+  void flush_fragment();
+
+  // m_pairs budget from the options, before m_memory cuts it, and whether it was cut
+  size_t m_pair_budget = 0;
+  bool m_pair_budget_cut = false;
+
+  // estimate of the region trees of the rules, for m_memory. The motif
+  // tries are not counted, as SeqLib doesn't expose them
+  size_t rule_bytes() const;
+  size_t m_rule_bytes = 0;
+
+  // m_sink asked to stop
+  bool m_sink_done = false;
+
+  // update m_memory from the current sizes. Lowers the m_pairs budget to
+  // what is left, and returns true if the other parts need to shrink
+  bool check_memory(size_t buffer_bytes);
+
+  // update m_metrics (if set) after a read
+  void update_metrics(const SeqLib::BamRecord& r, size_t buffered);
+
+  // reads at the furthest position seen so far, for m_dedup_regions
+  int32_t m_dedup_chr = -1;
+  int32_t m_dedup_pos = -1;
+  std::vector<std::string> m_dedup_reads;
+
+  // true if an earlier region already returned this read
+  bool repeated_read(const SeqLib::BamRecord& r);
+
+  RegionPrefetcher m_prefetch;
+
+  // first of m_requested that may overlap the current read
+  size_t m_requested_next = 0;
+
+  // true if the read (from a coalesced span) doesn't overlap m_requested
+  bool outside_requested(const SeqLib::BamRecord& r);
+
+  // reused by TrimRecord for -Z
+  std::vector<uint32_t> m_cigar_scratch;
+
+  // evaluate the rules, setting one bit in routes per passing output route
+  bool evaluate(SeqLib::BamRecord& r, uint64_t& routes);
+
+  // reads taken ahead of the loop that writes them, so the rules can be
+  // evaluated on several threads
+  struct ReadBatch {
+    SeqLib::BamRecordVector reads;
+    std::vector<uint64_t> routes;
+    std::vector<char> pass;
+    size_t next = 0; // next read to write
+    bool evaluated = false;
+  };
+
+  // add the -Z tags and evaluate the rules on a batch, on this thread plus
+  // nthreads - 1 jobs on the pool. Routes are evaluated on one thread
+  void evaluate_batch(ReadBatch& b, int nthreads);
+
+  // rules for the evaluate_batch jobs, one per job, from m_build_rules.
+  // They keep their own rule counts, which EmitCounts adds up
+  std::vector<SeqLib::Filter::ReadFilterCollection> m_rule_copies;
+
+  // the htslib pool, and the queue of evaluate_batch jobs on it. The pool
+  // threads are the only extra ones, so evaluation and (de)compression
+  // share -t between them
+  SeqLib::ThreadPool m_pool;
+  std::unique_ptr<hts_tpool_process, void(*)(hts_tpool_process*)> m_eval_queue{nullptr, hts_tpool_process_destroy};
+
+  // true if there is at least one open output
+  bool is_writing() const;
+
+  // a read passed the rules (and any coverage sampling)
+  void keep_record(SeqLib::BamRecord& r, uint64_t routes);
+
+  void write_record(SeqLib::BamRecord& r, uint64_t routes);
+
+  void reject_record(SeqLib::BamRecord& r);
+
+  // flush the output and save the state of the run to m_checkpoint_file
+  void write_checkpoint(const InputPosition& last, const InputPosition& replay, const InputPosition& flushed,
+			bool cov_a_live, int32_t buffer_size);
+
+  // write to one output, throwing VariantBamError if the write fails. FASTQ output writes only the bases [start, end)
+  void write_to(OutputWriter& w, const SeqLib::BamRecord& r, int32_t start = 0, int32_t end = INT32_MAX);
 
 };
 #endif
@@ -18,11 +18,19 @@ limitations under the License.
 #include <getopt.h>
 #include <iostream>
 #include <fstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <algorithm>
+#include <sys/stat.h>
 
 #include "SeqLib/SeqLibUtils.h"
 #include "SeqLib/GenomicRegionCollection.h"
 #include "SeqLib/GenomicRegion.h"
 #include "SeqLib/SeqLibCommon.h"
+#include "json/json.h"
 
 #include "VariantBamWalker.h"
 #include "CommandLineRegion.h"
@@ -38,22 +46,50 @@ static const char *VARIANT_BAM_USAGE_MESSAGE =
 " General options\n"
 "  -h, --help                           Display this help and exit\n"
 "  -v, --verbose                        Verbose output\n"
+"      --metrics                        Write progress as JSON lines to this file, FIFO or unix:<socket path>. Reports the -m buffer and the rule jobs queued on the pool, not the BGZF (de)compression queues\n"
+"      --metrics-interval               Seconds between --metrics records [10]\n"
   //"  -c, --counts-file                    File to place read counts per rule / region\n"
-"  -t, --num-threads                    Add additional threads from pool for reading/writing. Per htslib, -t 1 adds one additional thread to main. [0]\n"
+"  -t, --num-threads                    Add additional threads from pool for reading/writing. Per htslib, -t 1 adds one additional thread to main. With -k UN, also evaluates rules on that many more threads. [0]\n"
+"      --auto-threads                   Evaluate rules on batches of reads, moving threads of the -t budget between rule evaluation and reading/writing as the run shows pays off. Adapts on read/write wait times, not the htslib queue depths, and doesn't resize the pool\n"
+"      --max-memory                     MB for the coverage window, buffers, pair table, stats and rule regions (not motif tries). Over it, -m flushes its window early and --link-pairs spills [no limit]\n"
 "  -x, --no-output                      Don't output reads (used for profiling with -q)\n"
+"      --estimate                       Don't filter, but estimate the kept reads, output size and time from a sample of an indexed BAM\n"
 "  -r, --rules                          JSON ecript for the rules.\n"
 "  -k, --proc-regions-file              Samtools-style region string (e.g. 1:1,000-2,000) or BED/VCF of regions to process. -k UN iterates over unmapped-unmapped reads\n"
+"      --prefetch                       MB of the next -k regions to read ahead of the current one, for network storage. Needs an indexed BAM [0]\n"
+"      --region-gap                     Read -k regions of an indexed BAM less than this many compressed bytes apart in one pass. -1 to seek to each region [65536]\n"
 "  -Q, --mark-as-qc-fail                Flag reads that don't pass VariantBam with the failed QC flag, rather than deleting the read.\n"
+"      --batch                          Manifest of files to filter with the same rules, one \"<input> <output> [<qc file>]\" per line. Rules are built once\n"
+"      --batch-jobs                     Number of manifest files to filter at once (with --batch) [1]\n"
 " Output options\n"
 "  -o, --output                         Output file to write to (BAM/SAM/CRAM) file instead of stdout\n"
+"                                       Give as <group>=<file> (repeatable) to send each top-level rule group of -r to its own file in one pass\n"
+"      --rejected                       Also write reads that fail all rules to this file (instead of -Q marking)\n"
 "  -C, --cram                           Output file should be in CRAM format\n"
 "  -b, --bam                            Output should be in binary BAM format\n"
+"      --fastq                          Output FASTQ instead: \"single\", \"interleaved\" or \"split\" (with --fastq-r2). BGZF if -b or the file ends in .gz\n"
+"      --fastq-r2                       File for the second reads of pairs, with --fastq split\n"
+"      --split-read-groups              Write each read group to <prefix><read group>.bam (or .fq.gz with --fastq) instead of -o\n"
+"      --max-open-files                 Most --split-read-groups files to keep open at once. Others are closed and appended to later [256]\n"
 "  -T, --reference                      Path to reference. Required for reading/writing CRAM\n"
+"      --write-index                    Build the .bai (BAM) or .crai (CRAM) index while writing the output. Input must be sorted\n"
+"      --csi                            Same as --write-index, but build a .csi index\n"
+"      --checkpoint                     Save the state of the run to <output>.ckpt about every this many reads. Needs sorted, indexed input and -b -o <file>\n"
+"      --resume                         Resume an interrupted --checkpoint run from <output>.ckpt. Use the same options as the first run\n"
 "  -s, --strip-tags                     Remove the specified tags, separated by commas. eg. -s RG,MD\n"
 "  -S, --strip-all-tags                 Remove all alignment tags\n"
+"      --keep-tags                      Remove all alignment tags except the specified ones. eg. --keep-tags RG,NM\n"
+"      --rename-reads                   Replace read names with 11-character hashes of them, shared by mates\n"
+"      --rename-map                     With --rename-reads, also write \"<new name>\t<old name>\" lines to this file\n"
+"      --bin-qualities                  Bin the base qualities of kept reads: \"illumina\" (8 levels), or bins like 2-19:12,20-29:25,30-:37\n"
 "  -Z, --write-trimmed                  Output the base-quality trimmed sequence rather than the original sequence. Also removes quality scores\n"
 " Filtering options\n"
 "  -q, --qc-file                        Output a qc file that contains information about BAM\n"
+"      --input-coverage                 Write a bedGraph of the depth of all input reads (.gz for BGZF). Input must be sorted\n"
+"      --kept-coverage                  Write a bedGraph of the depth of the kept reads (.gz for BGZF). Input must be sorted\n"
+"      --link-pairs                     Keep both mates of a pair if either passes the rules (or reject both). Output is in order of pairing, not sorted\n"
+"      --collated                       Input is grouped by read name (e.g. samtools collate). Keep or reject each fragment whole, if \"any\" or \"all\" of its alignments pass\n"
+"      --pair-memory                    MB of unpaired reads to hold for --link-pairs before spilling to temporary files in $TMPDIR (at least 16) [512]\n"
 "  -m, --max-coverage                   Maximum coverage of output file. BAM must be sorted. Negative values enforce a minimum coverage\n"
 "  -p, --min-phred                      Set the minimum base quality score considered to be high-quality\n"
 " Region specifiers\n"
@@ -90,6 +126,33 @@ namespace opt {
   static std::string blacklist;
   static std::string bam;
   static std::string out;
+  static std::vector<std::string> outs; // all -o targets
+  static std::string rejected; // output for reads failing all rules
+  static std::string batch; // manifest of input / output pairs
+  static int batch_jobs = 1; // number of files to process at once
+  static bool write_index = false; // build the output index while writing
+  static bool csi_index = false; // make .csi instead of .bai
+  static uint64_t checkpoint_every = 0; // reads between checkpoints
+  static bool resume = false; // resume from <out>.ckpt
+  static std::string metrics; // file, FIFO or unix:<socket> for live metrics
+  static double metrics_interval = 10; // seconds between metrics records
+  static std::string input_coverage; // bedGraph of all input reads
+  static std::string kept_coverage; // bedGraph of kept reads
+  static bool link_pairs = false; // keep or reject mates together
+  static size_t pair_memory = 512; // MB of reads waiting for their mates
+  static std::string collated; // "any" or "all", for name-grouped input
+  static int64_t region_gap = 65536; // bytes between -k regions to read through, rather than seek
+  static size_t prefetch = 0; // MB to read ahead of the current region
+  static bool estimate = false; // dry run on a sample of the input
+  static size_t max_memory = 0; // MB for the walker's big structures. 0 is no limit
+  static std::string fastq; // "single", "interleaved" or "split" FASTQ output
+  static std::string fastq_r2; // second reads, for split FASTQ
+  static std::string split_rg; // prefix of the per-read-group outputs
+  static size_t max_open_files = 256; // per-read-group outputs open at once
+  static bool auto_threads = false; // share -t between rules and the pool as the run goes
+  static std::string bin_quals; // quality bins for the output
+  static bool rename_reads = false; // hash the read names
+  static std::string rename_map; // file of new and old read names
   static int max_cov = 0;
   static bool verbose = false;
   static std::string rules;
@@ -98,6 +161,7 @@ namespace opt {
   static std::string reference;
   static bool strip_all_tags = false;
   static std::string tag_list;
+  static std::string keep_tags;
   static std::string counts_file;
   static bool noop = false;
   static std::string bam_qcfile;
@@ -115,7 +179,34 @@ enum {
   OPT_CLIP,
   OPT_MOTIF,
   OPT_INS, 
-  OPT_DEL
+  OPT_DEL,
+  OPT_REJECTED,
+  OPT_BATCH,
+  OPT_BATCH_JOBS,
+  OPT_WRITE_INDEX,
+  OPT_CSI,
+  OPT_CHECKPOINT,
+  OPT_RESUME,
+  OPT_METRICS,
+  OPT_METRICS_INTERVAL,
+  OPT_KEEP_TAGS,
+  OPT_INPUT_COVERAGE,
+  OPT_KEPT_COVERAGE,
+  OPT_LINK_PAIRS,
+  OPT_PAIR_MEMORY,
+  OPT_COLLATED,
+  OPT_REGION_GAP,
+  OPT_PREFETCH,
+  OPT_ESTIMATE,
+  OPT_MAX_MEMORY,
+  OPT_FASTQ,
+  OPT_FASTQ_R2,
+  OPT_SPLIT_RG,
+  OPT_MAX_OPEN_FILES,
+  OPT_AUTO_THREADS,
+  OPT_BIN_QUALITIES,
+  OPT_RENAME_READS,
+  OPT_RENAME_MAP
 };
 
 static const char* shortopts = "hvbxi:o:r:k:g:Cf:s:ST:l:c:q:m:L:G:P:F:R:p:QZt:";
@@ -145,10 +236,37 @@ static const struct option longopts[] = {
   { "cram",                       no_argument, NULL, 'C' },
   { "strip-all-tags",             no_argument, NULL, 'S' },
   { "strip-tags",                 required_argument, NULL, 's' },
+  { "keep-tags",                  required_argument, NULL, OPT_KEEP_TAGS },
   { "reference",                  required_argument, NULL, 'T' },
   { "verbose",                    no_argument, NULL, 'v' },
   { "input",                      required_argument, NULL, 'i' },
   { "output",                 required_argument, NULL, 'o' },
+  { "rejected",                 required_argument, NULL, OPT_REJECTED },
+  { "batch",                 required_argument, NULL, OPT_BATCH },
+  { "batch-jobs",                 required_argument, NULL, OPT_BATCH_JOBS },
+  { "write-index",                 no_argument, NULL, OPT_WRITE_INDEX },
+  { "csi",                 no_argument, NULL, OPT_CSI },
+  { "checkpoint",                 required_argument, NULL, OPT_CHECKPOINT },
+  { "resume",                 no_argument, NULL, OPT_RESUME },
+  { "metrics",                 required_argument, NULL, OPT_METRICS },
+  { "metrics-interval",                 required_argument, NULL, OPT_METRICS_INTERVAL },
+  { "input-coverage",                 required_argument, NULL, OPT_INPUT_COVERAGE },
+  { "kept-coverage",                 required_argument, NULL, OPT_KEPT_COVERAGE },
+  { "link-pairs",                 no_argument, NULL, OPT_LINK_PAIRS },
+  { "pair-memory",                 required_argument, NULL, OPT_PAIR_MEMORY },
+  { "collated",                 required_argument, NULL, OPT_COLLATED },
+  { "region-gap",                 required_argument, NULL, OPT_REGION_GAP },
+  { "prefetch",                 required_argument, NULL, OPT_PREFETCH },
+  { "estimate",                 no_argument, NULL, OPT_ESTIMATE },
+  { "max-memory",                 required_argument, NULL, OPT_MAX_MEMORY },
+  { "fastq",                 required_argument, NULL, OPT_FASTQ },
+  { "fastq-r2",                 required_argument, NULL, OPT_FASTQ_R2 },
+  { "split-read-groups",                 required_argument, NULL, OPT_SPLIT_RG },
+  { "max-open-files",                 required_argument, NULL, OPT_MAX_OPEN_FILES },
+  { "auto-threads",                 no_argument, NULL, OPT_AUTO_THREADS },
+  { "bin-qualities",                 required_argument, NULL, OPT_BIN_QUALITIES },
+  { "rename-reads",                 no_argument, NULL, OPT_RENAME_READS },
+  { "rename-map",                 required_argument, NULL, OPT_RENAME_MAP },
   { "qc-file",                    no_argument, NULL, 'q' },
   { "rules",                      required_argument, NULL, 'r' },
   { "region",                     required_argument, NULL, 'g' },
@@ -169,6 +287,18 @@ std::string myreplace(std::string &s,
 
 // forward declare
 void parseVarOptions(int argc, char** argv);
+static void openWriter(OutputWriter& w, const std::string& fn, const SeqLib::BamHeader& hdr, SeqLib::ThreadPool& pool);
+static void buildRoutes(VariantBamWalker& reader, SeqLib::ThreadPool& pool);
+static bool isRouted();
+static void configureWalker(VariantBamWalker& reader);
+static SeqLib::Filter::ReadFilterCollection buildRules(const SeqLib::BamHeader& hdr, bool verbose);
+static GRC buildProcRegions(const SeqLib::BamHeader& hdr);
+static GRC planRegions(const SeqLib::BamHeader& hdr);
+static bool canSkipUnkeptReads(const std::string& in, const std::string& qcfile);
+static void setProcRegions(VariantBamWalker& reader, const GRC& regions, const std::string& in);
+static int runBatch();
+static void setupCheckpoint(VariantBamWalker& reader, SeqLib::ThreadPool& pool);
+static int runEstimate(VariantBamWalker& reader);
 
 // helper for formatting rules script string with no whitespace
 // http://stackoverflow.com/questions/83439/remove-spaces-from-stdstring-in-c
@@ -193,6 +323,10 @@ int main(int argc, char** argv) {
   // parse the command line
   parseVarOptions(argc, argv);
 
+  // many input files, sharing one set of rules
+  if (!opt::batch.empty())
+    return runBatch();
+
   bool has_ml_region = opt::rules.find("mlregion") != std::string::npos;
   
   if (opt::verbose) {
@@ -223,73 +357,44 @@ int main(int argc, char** argv) {
     exit(EXIT_FAILURE);
   }
 
-    
-  // set whether to mark failed as QC fail, or just delete (default)
-  reader.m_mark_qc_fail = opt::mark_as_qcfail;
-  
-  // set the phred trim limit
-  reader.phred = opt::phred;
 
-  GRC grv_proc_regions;
-  if (opt::proc_regions.length()) {
-    if (SeqLib::read_access_test(opt::proc_regions)) {
-      grv_proc_regions = GRC(opt::proc_regions, reader.Header());
-    } else if (opt::proc_regions.find(":") != std::string::npos) {
-      grv_proc_regions.add(SeqLib::GenomicRegion(opt::proc_regions, reader.Header()));
-    } else if (opt::proc_regions == "-1" || opt::proc_regions == "UN") {
-      grv_proc_regions.add(SeqLib::GenomicRegion(-2, 0, 0));
-    } else {
-      std::cerr << "...unexpected region format or could not read file" << std::endl;
+  // set the per-run options of the walker
+  configureWalker(reader);
+  reader.m_prefetch_file = opt::bam;
+
+  GRC grv_proc_regions = buildProcRegions(reader.Header());
+
+  // open for writing
+  if (!opt::noop && !opt::split_rg.empty()) {
+    OutputWriter proto = opt::fastq.empty() ? OutputWriter(SeqLib::BAM) :
+      OutputWriter(opt::fastq == "single" ? OutputWriter::FASTQ_SINGLE : OutputWriter::FASTQ_PAIRED, true);
+    reader.m_rg_split.Init(opt::split_rg, opt::fastq.empty() ? ".bam" : ".fq.gz", proto, reader.Header(), pool, opt::max_open_files);
+  } else if (!opt::noop && isRouted()) {
+    buildRoutes(reader, pool); // one output per rule group
+  } else if (opt::checkpoint_every || opt::resume) {
+    setupCheckpoint(reader, pool); // opens (or reopens) the output
+  } else if (!opt::noop) {
+    openWriter(reader.m_writer, opt::out, reader.Header(), pool);
+    if (!opt::fastq_r2.empty() && !reader.m_writer.OpenR2(opt::fastq_r2)) {
+      std::cerr << "ERROR: could not open output FASTQ " << opt::fastq_r2 << std::endl;
       exit(EXIT_FAILURE);
     }
-    grv_proc_regions.CreateTreeMap();
   }
 
-  // open for writing
-  if (!opt::noop) {
-    if (opt::out.empty()) {
-      reader.m_writer = SeqLib::BamWriter(opt::bam_output ? SeqLib::BAM : SeqLib::SAM);
-      reader.m_writer.SetHeader(reader.Header());
-      reader.m_writer.Open("-");
-    }
-    // should we print to cram
-    else if (opt::cram) {
-      reader.m_writer = SeqLib::BamWriter(SeqLib::CRAM);
-      reader.m_writer.SetHeader(reader.Header());
+  if (!opt::noop && !opt::rejected.empty())
+    openWriter(reader.m_rejected_writer, opt::rejected, reader.Header(), pool);
 
-      if (!reader.m_writer.Open(opt::out)) {
-	std::cerr << "ERROR: could not open output CRAM " << opt::out << std::endl;
-	exit(EXIT_FAILURE);
-      }
-      if (!reader.m_writer.SetCramReference(opt::reference)) {
-	std::cerr << "Failed to set CRAM reference file: " << opt::reference << std::endl;
-	exit(EXIT_FAILURE);
-      }
-    } else {
-      reader.m_writer = SeqLib::BamWriter(opt::bam_output ? SeqLib::BAM : SeqLib::SAM);
-      reader.m_writer.SetHeader(reader.Header());
-      if (!reader.m_writer.Open(opt::out)) {
-	std::cerr << "ERROR: could not open output " << (opt::bam_output ? "BAM" : "SAM") << opt::out << std::endl;
-	exit(EXIT_FAILURE);
-      }
-    }
-    reader.m_writer.WriteHeader();
-
-    // set threads for multicore
-    if (pool.IsOpen()) 
-      if (!reader.m_writer.SetThreadPool(pool))
-	std::cerr << "trying to set unopened pool" << std::endl;
+  if (!opt::input_coverage.empty() && !reader.m_input_coverage.Open(opt::input_coverage, reader.Header())) {
+    std::cerr << "ERROR: could not open coverage track " << opt::input_coverage << std::endl;
+    exit(EXIT_FAILURE);
   }
-
-  // should we clear tags?
-  if (opt::strip_all_tags)
-    reader.m_strip_all_tags = true; //.setStripAllTags();
-  else if (opt::tag_list.length()) {
-    std::istringstream iss(opt::tag_list);
-    std::string val;
-    while(std::getline(iss, val, ',')) {
-      reader.m_tags_to_strip.push_back(val);
-    }
+  if (!opt::kept_coverage.empty() && !reader.m_kept_coverage.Open(opt::kept_coverage, reader.Header())) {
+    std::cerr << "ERROR: could not open coverage track " << opt::kept_coverage << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (!opt::noop && !opt::rename_map.empty() && !reader.m_renamer.OpenMap(opt::rename_map)) {
+    std::cerr << "ERROR: could not open read name map " << opt::rename_map << std::endl;
+    exit(EXIT_FAILURE);
   }
 
   // make the mini rules collection from the rules file
@@ -300,44 +405,19 @@ int main(int argc, char** argv) {
     std::cerr << "Rules script: " << str << std::endl;
   }
 
-  SeqLib::Filter::ReadFilterCollection rfc;
+  SeqLib::Filter::ReadFilterCollection rfc = buildRules(reader.Header(), opt::verbose);
   
-  if (!opt::rules.empty())
-    rfc = SeqLib::Filter::ReadFilterCollection(opt::rules, reader.Header());
+  reader.m_mr = rfc;
 
-  // make sure command_line_reigons makes sense
-  if (command_line_regions.size() == 2 && command_line_regions[1].all()) {
-    std::cerr << "***************************************************" << std::endl
-              << "  Region (-l, -L, -g, -G) supplied after rule flags"
-              << "  Did you mean to set region flag before rule flags"
-              << "***************************************************" << std::endl;
+  if (reader.m_routes.size() && command_line_regions.size()) {
+    std::cerr << "ERROR: Multiple outputs (-o <group>=<file>) take their rules from -r only, not from command line rules" << std::endl;
     exit(EXIT_FAILURE);
   }
-    
-
-  if (opt::verbose && command_line_regions.size())
-    std::cerr << "...building rules from command line" << std::endl;
-
-  // add specific mini rules from command-line
-  for (auto& i : command_line_regions) {
-    SeqLib::Filter::ReadFilter rf = BuildReadFilterFromCommandLineRegion(i, reader.Header());
-    //SeqLib::MiniRules mr(i, walk.header());
-    //SeqLib::ReadFilter rf(i, reader.Header());
-    //mr.pad = i.pad;
-    //mr.mrc = &mrc;
-    rfc.AddReadFilter(rf);
-    //mrc.m_regions.push_back(mr);
-  }
-
-  rfc.CheckHasIncluder();
-  
-  reader.m_mr = rfc;
 
   if (opt::verbose)
     std::cerr << rfc << std::endl;
 
   // set max coverage
-  reader.max_cov = opt::max_cov;
   if (opt::max_cov > 0 && opt::verbose)
     std::cerr << "--- Setting MAX coverage to: " << opt::max_cov << std::endl;
 
@@ -346,7 +426,18 @@ int main(int argc, char** argv) {
     if (opt::verbose)
        std::cerr << "...from -g flag will run on " << grv_proc_regions.size() << " regions" << std::endl;
     //walk.setBamWalkerRegions(grv_proc_regions.asGenomicRegionVector());
-    reader.SetMultipleRegions(grv_proc_regions);
+    setProcRegions(reader, grv_proc_regions, opt::bam);
+  }
+
+  // if the rules can only keep reads in some regions, read just those
+  if (!grv_proc_regions.size() && canSkipUnkeptReads(opt::bam, opt::bam_qcfile)) {
+    GRC plan = planRegions(reader.Header());
+    if (plan.size()) {
+      if (opt::verbose)
+	std::cerr << "...rules only keep reads in " << plan.size() << " regions. Will run on those only" << std::endl;
+      reader.SetMultipleRegions(plan);
+      reader.m_dedup_regions = true;
+    }
   }
 
   SeqLib::GRC rules_rg = grv_proc_regions; //reader.GetMiniRulesCollection().getAllRegions();
@@ -364,7 +455,7 @@ int main(int argc, char** argv) {
 
   if (grv_proc_regions.size() > 0 && (rules_rg.size() || has_ml_region )) // explicitly gave regions
     //walk.setBamWalkerRegions(grv_proc_regions.asGenomicRegionVector());
-    reader.SetMultipleRegions(grv_proc_regions);
+    setProcRegions(reader, grv_proc_regions, opt::bam);
   /*  else if (rules_rg.size() && !has_ml_region && grv_proc_regions.size() == 0) {
     walk.setBamWalkerRegions(rules_rg.asGenomicRegionVector());
     if (opt::verbose)
@@ -382,20 +473,38 @@ int main(int argc, char** argv) {
   if (opt::verbose) 
     std::cerr << reader << std::endl;
 
-  // set verbosity of walker
-  reader.m_verbose = opt::verbose;
-
   // do the filtering
   if (opt::verbose)
     std::cerr << "...starting filtering" << std::endl;
 
-  // set the trim writer opeion
-  reader.m_write_trimmed = opt::write_trimmed;
+  // just the dry run
+  if (opt::estimate)
+    return runEstimate(reader);
+
+  // live metrics, from a separate thread
+  RunMetrics metrics;
+  MetricsEmitter emitter;
+  if (!opt::metrics.empty()) {
+    reader.m_metrics = &metrics;
+    emitter.Start(opt::metrics, &metrics, reader.Header(), opt::metrics_interval);
+  }
 
   ////////////
   /// RUN THE WALKER
   ////////////
-  reader.writeVariantBam();
+  try {
+    reader.writeVariantBam();
+  } catch (const VariantBamError& e) {
+    emitter.Stop();
+    std::cerr << "ERROR: " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  emitter.Stop();
+
+  // finished, so nothing left to resume
+  if (!reader.m_checkpoint_file.empty())
+    std::remove(reader.m_checkpoint_file.c_str());
 
   // dump the stats file
   if (!opt::bam_qcfile.empty()) {
@@ -409,7 +518,7 @@ int main(int argc, char** argv) {
   /*
   std::ofstream cfile;
   cfile.open(opt::counts_file.c_str());
-  cfile << reader.m_mr.EmitCounts(); //MiniRulesToFile(opt::counts_file);
+  cfile << reader.EmitCounts(); //MiniRulesToFile(opt::counts_file);
   cfile.close();
   */
 
@@ -421,6 +530,802 @@ int main(int argc, char** argv) {
   return 0;
 }
 
+// sample small windows spread evenly over the reads counted in the index,
+// and scale what the rules keep there up to the whole file
+static int runEstimate(VariantBamWalker& reader) {
+
+  static const int NUM_WINDOWS = 300;
+  static const int32_t WINDOW_WIDTH = 1000;
+  static const size_t WINDOW_READS = 200; // per window
+  static const size_t UNPLACED_READS = 2000;
+
+  htsFile* fp = opt::bam == "-" ? nullptr : hts_open(opt::bam.c_str(), "r");
+  hts_idx_t* idx = fp ? sam_index_load(fp, opt::bam.c_str()) : nullptr;
+  if (!idx) {
+    std::cerr << "ERROR: --estimate needs an indexed BAM" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  const SeqLib::BamHeader& hdr = reader.Header();
+  std::vector<uint64_t> placed(hdr.NumSequences(), 0);
+  uint64_t total = 0;
+  for (int i = 0; i < hdr.NumSequences(); ++i) {
+    uint64_t mapped = 0, unmapped = 0;
+    if (hts_idx_get_stat(idx, i, &mapped, &unmapped) == 0)
+      placed[i] = mapped + unmapped;
+    total += placed[i];
+  }
+  const uint64_t unplaced = hts_idx_get_n_no_coor(idx);
+  hts_idx_destroy(idx);
+  hts_close(fp);
+
+  if (!total && !unplaced) {
+    std::cerr << "ERROR: the index of " << opt::bam << " has no read counts to scale the estimate by" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // the window of the i-th of NUM_WINDOWS evenly spaced reads
+  EstimateSample s;
+  size_t c = 0;
+  uint64_t before = 0; // reads on the contigs before c
+  for (int i = 0; i < NUM_WINDOWS && total; ++i) {
+    uint64_t target = (uint64_t)((i + 0.5) * total / NUM_WINDOWS);
+    while (before + placed[c] <= target)
+      before += placed[c++];
+    int32_t len = hdr.GetSequenceLength(c);
+    int32_t pos = (int32_t)((double)(target - before) / placed[c] * len);
+    reader.SampleRegion(GenomicRegion(c, pos + 1, std::min(pos + WINDOW_WIDTH, len)), WINDOW_READS, s);
+  }
+
+  EstimateSample u;
+  if (unplaced)
+    reader.SampleRegion(GenomicRegion(-2, 0, 0), UNPLACED_READS, u);
+
+  if (!s.reads && !u.reads) {
+    std::cerr << "ERROR: could not read any of the sampled windows of " << opt::bam << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // kept reads, and their BAM size at the compression of the input
+  double kept = (s.reads ? s.kept / s.reads * total : 0) + (u.reads ? u.kept / u.reads * unplaced : 0);
+  double record_ratio = (s.kept + u.kept) > 0 ?
+    ((s.kept_bytes + u.kept_bytes) / (s.kept + u.kept)) / ((double)(s.bytes + u.bytes) / (s.reads + u.reads)) : 1;
+  struct stat st;
+  double file_bytes = stat(opt::bam.c_str(), &st) == 0 ? st.st_size : 0;
+  double out_bytes = kept * record_ratio * file_bytes / (total + unplaced);
+  double seconds = s.timed_reads + u.timed_reads ?
+    (s.seconds + u.seconds) / (s.timed_reads + u.timed_reads) * (total + unplaced) : 0;
+
+  std::cout << "Estimate from " << SeqLib::AddCommas<uint64_t>(s.reads + u.reads) << " reads in " << NUM_WINDOWS 
+	    << " windows" << (unplaced ? " and the unplaced reads" : "") << std::endl
+	    << "  input reads:  " << SeqLib::AddCommas<uint64_t>(total + unplaced) << std::endl
+	    << "  kept reads:   " << SeqLib::AddCommas<uint64_t>((uint64_t)kept) << " ("
+	    << SeqLib::percentCalc<uint64_t>((uint64_t)kept, total + unplaced) << "%)" << std::endl
+	    << "  output bytes: " << SeqLib::AddCommas<uint64_t>((uint64_t)out_bytes) << " (BAM)" << std::endl
+	    << "  filter time:  " << (uint64_t)(seconds + 0.5) << " s (reading and rules on one thread, without writing)" << std::endl;
+
+  return 0;
+}
+
+// open a BAM/SAM/CRAM writer according to the output flags. Empty or "-" is stdout
+static void openWriter(OutputWriter& w, const std::string& fn, const SeqLib::BamHeader& hdr, SeqLib::ThreadPool& pool) {
+
+  if (!opt::fastq.empty()) {
+    bool gz = fn.size() > 3 && (fn.compare(fn.size() - 3, 3, ".gz") == 0 ||
+				(fn.size() > 4 && fn.compare(fn.size() - 4, 4, ".bgz") == 0));
+    w = OutputWriter(opt::fastq == "single" ? OutputWriter::FASTQ_SINGLE : OutputWriter::FASTQ_PAIRED, gz || opt::bam_output);
+    w.SetHeader(hdr);
+    if (!w.Open(fn.empty() ? "-" : fn)) {
+      std::cerr << "ERROR: could not open output FASTQ " << fn << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (fn.empty() || fn == "-") {
+    w = OutputWriter(opt::bam_output ? SeqLib::BAM : SeqLib::SAM);
+    w.SetHeader(hdr);
+    w.Open("-");
+  }
+  // should we print to cram
+  else if (opt::cram) {
+    w = OutputWriter(SeqLib::CRAM);
+    w.SetHeader(hdr);
+    
+    if (!w.Open(fn)) {
+      std::cerr << "ERROR: could not open output CRAM " << fn << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (!w.SetCramReference(opt::reference)) {
+      std::cerr << "Failed to set CRAM reference file: " << opt::reference << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    w = OutputWriter(opt::bam_output ? SeqLib::BAM : SeqLib::SAM);
+    w.SetHeader(hdr);
+    if (!w.Open(fn)) {
+      std::cerr << "ERROR: could not open output " << (opt::bam_output ? "BAM" : "SAM") << fn << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+  w.WriteHeader();
+  
+  // set threads for multicore
+  if (pool.IsOpen()) 
+    if (!w.SetThreadPool(pool))
+      std::cerr << "trying to set unopened pool" << std::endl;
+
+  // index the output as it is written
+  if (opt::write_index && !w.SetBuildIndex(opt::csi_index ? 14 : 0)) {
+    std::cerr << "ERROR: could not index output " << fn << ". Indexing requires BAM (-b) or CRAM (-C) output to a file" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  
+}
+
+// set up periodic checkpoints of a run, or resume from the last one. The 
+// output must be a BAM file, so that it can be cut back to a BGZF block
+static void setupCheckpoint(VariantBamWalker& reader, SeqLib::ThreadPool& pool) {
+
+  if (opt::noop || opt::out.empty() || opt::out == "-" || !opt::bam_output || opt::cram || opt::bam == "-" ||
+      !opt::rejected.empty() || opt::write_index || !opt::proc_regions.empty() ||
+      !opt::input_coverage.empty() || !opt::kept_coverage.empty()) {
+    std::cerr << "ERROR: --checkpoint and --resume need indexed input and a single BAM output file (-b -o <file>)," << std::endl
+	      << "       and can't be used with -k, --rejected, --write-index or coverage tracks" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  reader.m_checkpoint_file = opt::out + ".ckpt";
+  reader.m_checkpoint_every = opt::checkpoint_every;
+  reader.m_checkpoint.input = opt::bam;
+  reader.m_checkpoint.output = opt::out;
+
+  if (!opt::resume) {
+    openWriter(reader.m_writer, opt::out, reader.Header(), pool);
+    return;
+  }
+
+  Checkpoint ck;
+  if (!ck.Read(reader.m_checkpoint_file)) {
+    std::cerr << "ERROR: could not read checkpoint " << reader.m_checkpoint_file << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  if (ck.input != opt::bam || ck.output != opt::out) {
+    std::cerr << "ERROR: checkpoint " << reader.m_checkpoint_file << " is for input " << ck.input 
+	      << " and output " << ck.output << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // cut the output back to the checkpoint and keep writing from there
+  reader.m_writer = OutputWriter(SeqLib::BAM);
+  reader.m_writer.SetHeader(reader.Header());
+  if (!reader.m_writer.OpenAppend(opt::out, ck.out_offset)) {
+    std::cerr << "ERROR: could not reopen " << opt::out << " to resume" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (pool.IsOpen()) 
+    if (!reader.m_writer.SetThreadPool(pool))
+      std::cerr << "trying to set unopened pool" << std::endl;
+
+  reader.m_resume = true;
+  reader.m_checkpoint = ck;
+
+  if (opt::verbose)
+    std::cerr << "...resuming after read " << ck.rc.totalString() << std::endl;
+
+}
+
+// make one output route per -o <group>=<file>. Each route gets a rules
+// collection built from the "global" block plus its own top-level group
+static void buildRoutes(VariantBamWalker& reader, SeqLib::ThreadPool& pool) {
+
+  if (opt::rules.empty()) {
+    std::cerr << "ERROR: Multiple outputs (-o <group>=<file>) require a rules script (-r)" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  if (opt::mark_as_qcfail) {
+    std::cerr << "ERROR: -Q is not available with multiple outputs. Use --rejected instead" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  if (opt::outs.size() > 64) {
+    std::cerr << "ERROR: At most 64 outputs are supported" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  Json::Value root;
+  Json::Reader json_reader;
+  if (!json_reader.parse(opt::rules, root)) {
+    std::cerr << "ERROR: failed to parse JSON rules script" << std::endl 
+	      << json_reader.getFormattedErrorMessages() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  for (const auto& o : opt::outs) {
+
+    size_t eq = o.find("=");
+    if (eq == std::string::npos || eq == 0) {
+      std::cerr << "ERROR: With multiple outputs, each -o must be <group>=<file>. Got: " << o << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    OutputRoute route;
+    route.name = o.substr(0, eq);
+
+    if (route.name == "global" || !root.isMember(route.name)) {
+      std::cerr << "ERROR: No rule group named \"" << route.name << "\" in the rules script" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    // script with just this group (plus global rules)
+    Json::Value sub(Json::objectValue);
+    if (root.isMember("global"))
+      sub["global"] = root["global"];
+    sub[route.name] = root[route.name];
+    route.rfc = SeqLib::Filter::ReadFilterCollection(Json::FastWriter().write(sub), reader.Header());
+    route.rfc.CheckHasIncluder();
+
+    openWriter(route.writer, o.substr(eq + 1), reader.Header(), pool);
+
+    if (opt::verbose)
+      std::cerr << "...rule group " << route.name << " will write to " << o.substr(eq + 1) << std::endl;
+
+    reader.m_routes.push_back(route);
+  }
+  
+}
+
+// multiple -o, or a single -o <group>=<file> naming a group of the rules script
+static bool isRouted() {
+
+  if (opt::outs.size() > 1)
+    return true;
+  if (opt::outs.empty() || opt::rules.empty())
+    return false;
+
+  size_t eq = opt::outs[0].find("=");
+  if (eq == std::string::npos)
+    return false;
+
+  Json::Value root;
+  Json::Reader json_reader;
+  return json_reader.parse(opt::rules, root) && root.isObject() && 
+    root.isMember(opt::outs[0].substr(0, eq));
+}
+
+// set the options of the walker that don't depend on the input file
+static void configureWalker(VariantBamWalker& reader) {
+
+  // set whether to mark failed as QC fail, or just delete (default)
+  reader.m_mark_qc_fail = opt::mark_as_qcfail;
+  
+  // set the phred trim limit
+  reader.phred = opt::phred;
+
+  // should we clear tags?
+  if (opt::strip_all_tags)
+    reader.m_strip_all_tags = true; //.setStripAllTags();
+  else if (opt::keep_tags.length())
+    reader.m_tag_filter = TagFilter(opt::keep_tags, true);
+  else if (opt::tag_list.length())
+    reader.m_tag_filter = TagFilter(opt::tag_list, false);
+
+  // coarser qualities compress better
+  if (opt::bin_quals.length())
+    reader.m_qual_bins = QualityBinner(opt::bin_quals);
+
+  // so do short read names. Mates hash alike, as for -m
+  if (opt::rename_reads)
+    reader.m_renamer.Init(reader.m_seed);
+
+  // set max coverage
+  reader.max_cov = opt::max_cov;
+
+  // set verbosity of walker
+  reader.m_verbose = opt::verbose;
+
+  // set the trim writer opeion
+  reader.m_write_trimmed = opt::write_trimmed;
+  reader.m_fastq = !opt::fastq.empty();
+
+  // only unmapped reads, so no regions or coverage to look at
+  reader.m_unmapped_only = opt::proc_regions == "-1" || opt::proc_regions == "UN";
+  reader.m_eval_threads = 1 + std::max(0, opt::nthreads);
+
+  // the rules and the thread pool share the -t budget
+  reader.m_auto_threads = opt::auto_threads;
+  reader.m_scheduler.SetMaxThreads(reader.m_eval_threads);
+  reader.m_build_rules = [&reader]() { return buildRules(reader.Header(), false); };
+  reader.m_track_stats = !opt::bam_qcfile.empty();
+
+  // one budget for the coverage window, buffers, pair table and stats
+  reader.m_memory.SetLimit(opt::max_memory << 20);
+
+  // read ahead of the regions, for slow storage
+  reader.m_prefetch_bytes = opt::prefetch << 20;
+
+  // hold mates until both have been seen
+  reader.m_pair_link = opt::link_pairs;
+  reader.m_pairs.SetBudget(std::max<size_t>(opt::pair_memory, 1) << 20);
+
+  // rules on whole fragments of name-grouped input
+  if (opt::collated == "any")
+    reader.m_fragment_rule = VariantBamWalker::FRAGMENT_ANY;
+  else if (opt::collated == "all")
+    reader.m_fragment_rule = VariantBamWalker::FRAGMENT_ALL;
+
+}
+
+// make the rules collection from the rules script and the command line rules
+static SeqLib::Filter::ReadFilterCollection buildRules(const SeqLib::BamHeader& hdr, bool verbose) {
+
+  SeqLib::Filter::ReadFilterCollection rfc;
+  
+  if (!opt::rules.empty())
+    rfc = SeqLib::Filter::ReadFilterCollection(opt::rules, hdr);
+
+  // make sure command_line_reigons makes sense
+  if (command_line_regions.size() == 2 && command_line_regions[1].all()) {
+    std::cerr << "***************************************************" << std::endl
+              << "  Region (-l, -L, -g, -G) supplied after rule flags"
+              << "  Did you mean to set region flag before rule flags"
+              << "***************************************************" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+    
+
+  if (verbose && command_line_regions.size())
+    std::cerr << "...building rules from command line" << std::endl;
+
+  // add specific mini rules from command-line
+  for (auto& i : command_line_regions) {
+    SeqLib::Filter::ReadFilter rf = BuildReadFilterFromCommandLineRegion(i, hdr);
+    //SeqLib::MiniRules mr(i, walk.header());
+    //SeqLib::ReadFilter rf(i, reader.Header());
+    //mr.pad = i.pad;
+    //mr.mrc = &mrc;
+    rfc.AddReadFilter(rf);
+    //mrc.m_regions.push_back(mr);
+  }
+
+  rfc.CheckHasIncluder();
+
+  return rfc;
+}
+
+// parse the -k regions
+static GRC buildProcRegions(const SeqLib::BamHeader& hdr) {
+
+  GRC grv_proc_regions;
+  if (opt::proc_regions.length()) {
+    if (SeqLib::read_access_test(opt::proc_regions)) {
+      grv_proc_regions = GRC(opt::proc_regions, hdr);
+    } else if (opt::proc_regions.find(":") != std::string::npos) {
+      grv_proc_regions.add(SeqLib::GenomicRegion(opt::proc_regions, hdr));
+    } else if (opt::proc_regions == "-1" || opt::proc_regions == "UN") {
+      grv_proc_regions.add(SeqLib::GenomicRegion(-2, 0, 0));
+    } else {
+      std::cerr << "...unexpected region format or could not read file" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    // the walker pads regions under 1 kb. Pad them here instead, before they
+    // are merged or coalesced, so that padding can't make them overlap again
+    for (auto& r : grv_proc_regions)
+      if (r.chr >= 0 && r.Width() < 1000)
+	r.Pad(1000);
+
+    // an index and the coverage tracks need sorted reads, so visit each
+    // position once and in order
+    if (opt::write_index || !opt::input_coverage.empty() || !opt::kept_coverage.empty())
+      grv_proc_regions.MergeOverlappingIntervals();
+
+    grv_proc_regions.CreateTreeMap();
+  }
+
+  return grv_proc_regions;
+}
+
+// sort and merge regions that overlap or touch
+static std::vector<GenomicRegion> mergeRegions(std::vector<GenomicRegion> v) {
+
+  std::sort(v.begin(), v.end());
+
+  std::vector<GenomicRegion> out;
+  for (const auto& r : v) {
+    if (!out.empty() && out.back().chr == r.chr && r.pos1 <= out.back().pos2 + 1)
+      out.back().pos2 = std::max(out.back().pos2, r.pos2);
+    else
+      out.push_back(r);
+  }
+  return out;
+}
+
+// regions of a not covered by b. Both must be merged. The pieces keep one
+// base of overlap with b at each cut, so nothing is lost to off-by-one ends
+static GRC subtractRegions(const std::vector<GenomicRegion>& a, const std::vector<GenomicRegion>& b) {
+
+  GRC out;
+  size_t j = 0;
+  for (GenomicRegion r : a) {
+    while (j < b.size() && (b[j].chr < r.chr || (b[j].chr == r.chr && b[j].pos2 < r.pos1)))
+      ++j;
+    for (size_t k = j; k < b.size() && b[k].chr == r.chr && b[k].pos1 <= r.pos2; ++k) {
+      if (b[k].pos1 > r.pos1)
+	out.add(GenomicRegion(r.chr, r.pos1, b[k].pos1));
+      r.pos1 = std::max(r.pos1, b[k].pos2);
+    }
+    if (r.pos1 <= r.pos2)
+      out.add(r);
+  }
+  return out;
+}
+
+// true if a command line rule has conditions beyond its region
+static bool hasCommandLineRules(const CommandLineRegion& c) {
+  return c.len || c.mapq || c.nbases != INT_MAX || c.phred || c.clip || c.ins || c.del ||
+    !c.rg.empty() || !c.motif.empty() || c.i_flag || c.e_flag;
+}
+
+// The parts of the genome where a read could pass the rules. Empty if that
+// could be anywhere: a whole-genome or mate-linked include rule means any
+// read might be kept. Exclude regions are cut out only if they have no
+// rules of their own, so that every read in them fails.
+static GRC planRegions(const SeqLib::BamHeader& hdr) {
+
+  std::vector<GenomicRegion> incl, excl;
+  
+  if (!opt::rules.empty()) {
+
+    Json::Value root;
+    Json::Reader json_reader;
+    if (!json_reader.parse(opt::rules, root) || !root.isObject())
+      return GRC();
+
+    // global rules are added to every group, so no excluder takes everything
+    bool global_rules = false;
+    if (root.isMember("global")) {
+      if (root["global"].isMember("region"))
+	return GRC();
+      global_rules = !root["global"].empty();
+    }
+
+    for (const auto& name : root.getMemberNames()) {
+
+      if (name == "global")
+	continue;
+
+      const Json::Value& v = root[name];
+      if (!v.isObject())
+	return GRC();
+
+      bool exclude = false, has_rules = false;
+      for (const auto& key : v.getMemberNames()) {
+	if (key.find("mate") != std::string::npos || key == "mlregion")
+	  return GRC();
+	else if (key == "exclude") {
+	  if (!v[key].isBool())
+	    return GRC();
+	  exclude = v[key].asBool();
+	} else if (key == "rules")
+	  has_rules = !v[key].empty();
+	else if (key != "region" && key != "pad")
+	  has_rules = true;
+      }
+
+      if (v.isMember("region") && !v["region"].isString())
+	return GRC();
+      std::string reg = v.get("region", "WG").asString();
+      if (reg == "WG" || reg.empty()) {
+	if (exclude)
+	  continue;
+	return GRC();
+      }
+
+      if (exclude && (has_rules || global_rules))
+	continue;
+
+      GRC g(reg, hdr);
+      g.Pad(v.get("pad", 0).asInt());
+      std::vector<GenomicRegion>& dest = exclude ? excl : incl;
+      dest.insert(dest.end(), g.begin(), g.end());
+    }
+  }
+
+  for (const auto& c : command_line_regions) {
+    if (c.type < 0 || c.type == MINIRULES_MATE_LINKED)
+      return GRC();
+    if (c.type == MINIRULES_MATE_LINKED_EXCLUDE || (c.type == MINIRULES_REGION_EXCLUDE && hasCommandLineRules(c)))
+      continue;
+    GRC g(c.f, hdr);
+    g.Pad(c.pad);
+    std::vector<GenomicRegion>& dest = c.type == MINIRULES_REGION_EXCLUDE ? excl : incl;
+    dest.insert(dest.end(), g.begin(), g.end());
+  }
+
+  if (incl.empty())
+    return GRC();
+
+  return subtractRegions(mergeRegions(incl), mergeRegions(excl));
+}
+
+// true if the input has an index next to it, for region queries
+static bool hasIndex(const std::string& fn) {
+
+  if (fn == "-")
+    return false;
+
+  for (const char* ext : {".bai", ".csi", ".crai"})
+    if (SeqLib::read_access_test(fn + ext))
+      return true;
+
+  size_t dot = fn.rfind(".");
+  return dot != std::string::npos && SeqLib::read_access_test(fn.substr(0, dot) + ".bai");
+}
+
+// merge -k regions whose reads are in the same BGZF blocks, or less than gap
+// compressed bytes apart, into spans that are each read in one pass. The
+// merged regions go in requested. Empty if the input isn't an indexed BAM
+static GRC coalesceRegions(const GRC& regions, const std::string& fn, int64_t gap,
+			   std::vector<GenomicRegion>& requested) {
+
+  GRC out;
+  if (gap < 0 || fn == "-" || !hasIndex(fn))
+    return out;
+
+  requested.clear();
+  for (const auto& r : regions) {
+    if (r.chr < 0) // unmapped reads aren't in any span
+      return out;
+    requested.push_back(r);
+  }
+  requested = mergeRegions(requested);
+
+  htsFile* fp = hts_open(fn.c_str(), "r");
+  hts_idx_t* idx = fp && hts_get_format(fp)->format == bam ? sam_index_load(fp, fn.c_str()) : nullptr;
+  if (!idx) {
+    if (fp)
+      hts_close(fp);
+    return out;
+  }
+
+  std::vector<GenomicRegion> spans;
+  uint64_t span_end = 0; // file offset of the last block of the current span
+  for (const auto& r : requested) {
+    hts_itr_t* itr = sam_itr_queryi(idx, r.chr, std::max(r.pos1 - 1, 0), r.pos2);
+    if (!itr)
+      continue;
+    uint64_t beg = UINT64_MAX, end = 0;
+    for (int i = 0; i < itr->n_off; ++i) {
+      beg = std::min(beg, itr->off[i].u >> 16);
+      end = std::max(end, itr->off[i].v >> 16);
+    }
+    bool empty = itr->n_off == 0;
+    hts_itr_destroy(itr);
+
+    if (empty) // no reads to read
+      continue;
+    if (spans.size() && spans.back().chr == r.chr && beg <= span_end + gap) {
+      spans.back().pos2 = std::max(spans.back().pos2, r.pos2);
+      span_end = std::max(span_end, end);
+    } else {
+      spans.push_back(r);
+      span_end = end;
+    }
+  }
+
+  hts_idx_destroy(idx);
+  hts_close(fp);
+
+  for (const auto& s : spans)
+    out.add(s);
+  return out;
+}
+
+// point the walker at the -k regions, coalesced into spans where possible
+static void setProcRegions(VariantBamWalker& reader, const GRC& regions, const std::string& in) {
+
+  std::vector<GenomicRegion> requested;
+  GRC spans = coalesceRegions(regions, in, opt::region_gap, requested);
+  if (!spans.size()) {
+    reader.SetMultipleRegions(regions);
+    // a read can cross into the next region, so drop the repeats where
+    // the output has to be sorted
+    reader.m_dedup_regions = opt::write_index || !opt::input_coverage.empty() || !opt::kept_coverage.empty();
+    return;
+  }
+
+  if (opt::verbose)
+    std::cerr << "...reading " << regions.size() << " regions as " << spans.size() << " spans of the file" << std::endl;
+
+  reader.SetMultipleRegions(spans);
+  reader.m_requested = requested;
+  reader.m_dedup_regions = true; // a read can cross into the next span
+}
+
+// planned regions skip the reads that can't pass the rules. Only use them
+// if no other output needs every read, and the input can be queried. Not
+// with --link-pairs or --collated, where the mate of a kept read may be anywhere,
+// nor with -m, whose coverage counts the failing reads next to the kept ones
+static bool canSkipUnkeptReads(const std::string& in, const std::string& qcfile) {
+
+  if (!opt::rejected.empty() || opt::mark_as_qcfail || !qcfile.empty() || !opt::input_coverage.empty() ||
+      opt::checkpoint_every || opt::resume || opt::link_pairs || !opt::collated.empty() || opt::max_cov != 0)
+    return false;
+
+  return hasIndex(in);
+}
+
+// check that two headers have the same sequence dictionary, so that
+// rules and regions built against one can be used on the other
+static bool sameSequences(const SeqLib::BamHeader& a, const SeqLib::BamHeader& b) {
+
+  if (a.NumSequences() != b.NumSequences())
+    return false;
+
+  for (int i = 0; i < a.NumSequences(); ++i)
+    if (a.IDtoName(i) != b.IDtoName(i) || a.GetSequenceLength(i) != b.GetSequenceLength(i))
+      return false;
+
+  return true;
+}
+
+// one line of the --batch manifest
+struct BatchJob {
+
+  std::string in;
+  std::string out;
+  std::string qcfile;
+
+  ReadCount rc;
+  bool ok = false;
+  double seconds = 0;
+
+};
+
+// run every input of the manifest through the same rules. The rules and 
+// regions are parsed once, and the files are spread across a pool of workers
+// that all share one htslib thread pool
+static int runBatch() {
+
+  if (isRouted() || !opt::rejected.empty() || !opt::bam_qcfile.empty() || !opt::metrics.empty() ||
+      !opt::input_coverage.empty() || !opt::kept_coverage.empty()) {
+    std::cerr << "ERROR: --batch takes its outputs (and optional qc files) from the manifest. Don't combine with -o, --rejected, -q, --metrics or coverage tracks" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // read the manifest: <input> <output> [<qc file>] per line
+  std::vector<BatchJob> jobs;
+  std::ifstream iss(opt::batch);
+  if (!iss) {
+    std::cerr << "ERROR: could not read batch manifest " << opt::batch << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  std::string line;
+  while (std::getline(iss, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    std::istringstream ls(line);
+    BatchJob j;
+    ls >> j.in >> j.out >> j.qcfile;
+    if ((j.out.empty() && !opt::noop) || j.out == "-") {
+      std::cerr << "ERROR: each batch manifest line needs an input and an output file. Got: " << line << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    jobs.push_back(j);
+  }
+
+  if (jobs.empty()) {
+    std::cerr << "ERROR: no inputs in batch manifest " << opt::batch << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // rules and regions are built once, against the first header
+  SeqLib::BamHeader hdr;
+  {
+    SeqLib::BamReader first;
+    if (!first.Open(jobs[0].in)) {
+      std::cerr << "ERROR: could not open file " << jobs[0].in << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    hdr = first.Header();
+  }
+
+  const SeqLib::Filter::ReadFilterCollection rfc = buildRules(hdr, opt::verbose);
+  const GRC grv_proc_regions = buildProcRegions(hdr);
+  const GRC plan = grv_proc_regions.size() ? GRC() : planRegions(hdr);
+
+  if (opt::verbose)
+    std::cerr << rfc << std::endl << "...running " << jobs.size() << " files on " << opt::batch_jobs << " workers" << std::endl;
+
+  // one htslib pool for all of the readers and writers
+  SeqLib::ThreadPool pool; 
+  if (opt::nthreads > 0)
+    pool = SeqLib::ThreadPool(opt::nthreads);
+
+  std::atomic<size_t> next(0);
+  std::mutex log_mutex;
+
+  auto worker = [&]() {
+    for (size_t i = next++; i < jobs.size(); i = next++) {
+
+      BatchJob& j = jobs[i];
+      auto start = std::chrono::steady_clock::now();
+      
+      VariantBamWalker reader;
+      if (pool.IsOpen())
+	reader.SetThreadPool(pool);
+
+      if (!reader.Open(j.in)) {
+	std::lock_guard<std::mutex> lock(log_mutex);
+	std::cerr << "ERROR: could not open file " << j.in << " -- skipping" << std::endl;
+	continue;
+      }
+
+      if (!sameSequences(hdr, reader.Header())) {
+	std::lock_guard<std::mutex> lock(log_mutex);
+	std::cerr << "ERROR: " << j.in << " has different reference sequences than " << jobs[0].in << " -- skipping" << std::endl;
+	continue;
+      }
+
+      configureWalker(reader);
+      reader.m_prefetch_file = j.in;
+      reader.m_memory.SetLimit((opt::max_memory << 20) / std::max(1, opt::batch_jobs)); // shared by the workers
+      reader.m_track_stats = !j.qcfile.empty();
+      reader.m_mr = rfc; // copy, since the collection keeps per-run counts
+      
+      if (!opt::noop)
+	openWriter(reader.m_writer, j.out, reader.Header(), pool);
+      
+      if (grv_proc_regions.size()) {
+	setProcRegions(reader, grv_proc_regions, j.in);
+      } else if (plan.size() && canSkipUnkeptReads(j.in, j.qcfile)) {
+	reader.SetMultipleRegions(plan);
+	reader.m_dedup_regions = true;
+      }
+      
+      try {
+	reader.writeVariantBam();
+      } catch (const VariantBamError& e) {
+	std::lock_guard<std::mutex> lock(log_mutex);
+	std::cerr << "ERROR: " << e.what() << " -- skipping " << j.in << std::endl;
+	continue;
+      }
+
+      if (!j.qcfile.empty()) {
+	std::ofstream ofs(j.qcfile);
+	ofs << reader.m_stats;
+      }
+
+      j.rc = reader.rc_main;
+      j.ok = true;
+      j.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      if (opt::verbose) {
+	std::lock_guard<std::mutex> lock(log_mutex);
+	std::cerr << "...done " << j.in << " kept " << j.rc.keepString() << " of " << j.rc.totalString() << std::endl;
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (int i = 0; i < std::max(1, opt::batch_jobs); ++i)
+    workers.push_back(std::thread(worker));
+  for (auto& t : workers)
+    t.join();
+
+  // per-file report
+  int failed = 0;
+  std::cout << "Input\tOutput\tStatus\tTotal\tKept\tPercentKept\tSeconds" << std::endl;
+  for (const auto& j : jobs) {
+    std::cout << j.in << "\t" << j.out << "\t" << (j.ok ? "OK" : "FAILED") << "\t" << j.rc.total << "\t" 
+	      << j.rc.keep << "\t" << j.rc.percent() << "\t" << j.seconds << std::endl;
+    failed += !j.ok;
+  }
+
+  return failed ? EXIT_FAILURE : 0;
+}
+
 void parseVarOptions(int argc, char** argv) {
 
   bool die = false;
@@ -448,7 +1353,34 @@ void parseVarOptions(int argc, char** argv) {
     case 'Q': opt::mark_as_qcfail = true; break;
     case 'C': opt::cram = true; break;
     case 'i': arg >> opt::bam; break;
-    case 'o': arg >> opt::out; break;
+    case 'o': arg >> tmp; opt::outs.push_back(tmp); opt::out = tmp; break;
+    case OPT_REJECTED: arg >> opt::rejected; break;
+    case OPT_BATCH: arg >> opt::batch; break;
+    case OPT_BATCH_JOBS: arg >> opt::batch_jobs; break;
+    case OPT_WRITE_INDEX: opt::write_index = true; break;
+    case OPT_CSI: opt::write_index = true; opt::csi_index = true; break;
+    case OPT_CHECKPOINT: arg >> opt::checkpoint_every; break;
+    case OPT_RESUME: opt::resume = true; break;
+    case OPT_METRICS: arg >> opt::metrics; break;
+    case OPT_METRICS_INTERVAL: arg >> opt::metrics_interval; break;
+    case OPT_KEEP_TAGS: arg >> opt::keep_tags; break;
+    case OPT_INPUT_COVERAGE: arg >> opt::input_coverage; break;
+    case OPT_KEPT_COVERAGE: arg >> opt::kept_coverage; break;
+    case OPT_LINK_PAIRS: opt::link_pairs = true; break;
+    case OPT_PAIR_MEMORY: arg >> opt::pair_memory; break;
+    case OPT_COLLATED: arg >> opt::collated; break;
+    case OPT_REGION_GAP: arg >> opt::region_gap; break;
+    case OPT_PREFETCH: arg >> opt::prefetch; break;
+    case OPT_ESTIMATE: opt::estimate = opt::noop = true; break;
+    case OPT_MAX_MEMORY: arg >> opt::max_memory; break;
+    case OPT_FASTQ: arg >> opt::fastq; break;
+    case OPT_FASTQ_R2: arg >> opt::fastq_r2; break;
+    case OPT_SPLIT_RG: arg >> opt::split_rg; break;
+    case OPT_MAX_OPEN_FILES: arg >> opt::max_open_files; break;
+    case OPT_AUTO_THREADS: opt::auto_threads = true; break;
+    case OPT_BIN_QUALITIES: arg >> opt::bin_quals; break;
+    case OPT_RENAME_READS: opt::rename_reads = true; break;
+    case OPT_RENAME_MAP: arg >> opt::rename_map; opt::rename_reads = true; break;
     case 'm': arg >> opt::max_cov; break;
     case 'b': opt::bam_output = true; break;
     case 'l': 
@@ -540,9 +1472,88 @@ void parseVarOptions(int argc, char** argv) {
     }
   }
 
+  // in batch mode the inputs come from the manifest
+  if (!opt::batch.empty())
+    opt::bam = opt::batch;
+
   if (opt::bam == "")
     die = true;
 
+  if (opt::keep_tags.length() && opt::tag_list.length()) {
+    std::cerr << "ERROR: Use either -s/--strip-tags or --keep-tags, not both" << std::endl;
+    die = true;
+  }
+
+  // pairs are written as they resolve, so nothing that needs sorted output
+  if (opt::link_pairs && (opt::max_cov || opt::write_index || !opt::kept_coverage.empty() ||
+			  opt::checkpoint_every || opt::resume)) {
+    std::cerr << "ERROR: --link-pairs output is not sorted. It can't be used with -m, --write-index, --kept-coverage or --checkpoint" << std::endl;
+    die = true;
+  }
+
+  if (!opt::collated.empty() && opt::collated != "any" && opt::collated != "all") {
+    std::cerr << "ERROR: --collated takes \"any\" or \"all\", not " << opt::collated << std::endl;
+    die = true;
+  }
+
+  if (!opt::collated.empty() && opt::link_pairs) {
+    std::cerr << "ERROR: --collated already keeps whole fragments. Don't combine with --link-pairs" << std::endl;
+    die = true;
+  }
+
+  if (!opt::fastq.empty() && opt::fastq != "single" && opt::fastq != "interleaved" && opt::fastq != "split") {
+    std::cerr << "ERROR: --fastq takes \"single\", \"interleaved\" or \"split\", not " << opt::fastq << std::endl;
+    die = true;
+  }
+
+  if ((opt::fastq == "split") != !opt::fastq_r2.empty()) {
+    std::cerr << "ERROR: --fastq split writes the second reads to --fastq-r2. Give both or neither" << std::endl;
+    die = true;
+  }
+
+  // only one output has a --fastq-r2
+  if (opt::fastq == "split" && (!opt::batch.empty() || opt::outs.size() > 1 ||
+				(opt::outs.size() && opt::outs[0].find("=") != std::string::npos))) {
+    std::cerr << "ERROR: --fastq split writes a single output. Use interleaved with --batch or rule groups" << std::endl;
+    die = true;
+  }
+
+  // FASTQ can't be indexed or cut back to a checkpoint
+  if (!opt::fastq.empty() && (opt::cram || opt::write_index || opt::checkpoint_every || opt::resume)) {
+    std::cerr << "ERROR: --fastq can't be used with -C, --write-index or --checkpoint" << std::endl;
+    die = true;
+  }
+
+  // the reads of a pair have to come out together to stay in step
+  if ((opt::fastq == "interleaved" || opt::fastq == "split") && !opt::link_pairs && opt::collated.empty()) {
+    std::cerr << "ERROR: --fastq " << opt::fastq << " needs the mates together. Use --link-pairs, or --collated for name-grouped input" << std::endl;
+    die = true;
+  }
+
+  // each read group has its own output, closed and appended to as needed
+  if (!opt::split_rg.empty() && (opt::outs.size() || !opt::batch.empty() || !opt::fastq_r2.empty() || opt::cram ||
+				 opt::write_index || opt::checkpoint_every || opt::resume)) {
+    std::cerr << "ERROR: --split-read-groups names its own outputs. It can't be used with -o, --batch, --fastq split, -C, --write-index or --checkpoint" << std::endl;
+    die = true;
+  }
+
+  if (opt::bin_quals.length() && !QualityBinner(opt::bin_quals).IsValid()) {
+    std::cerr << "ERROR: could not read --bin-qualities " << opt::bin_quals << ". Use \"illumina\" or bins like 2-19:12,30-:37" << std::endl;
+    die = true;
+  }
+
+  // one map, written from the start
+  if (!opt::rename_map.empty() && (!opt::batch.empty() || opt::checkpoint_every || opt::resume)) {
+    std::cerr << "ERROR: --rename-map can't be used with --batch or --checkpoint" << std::endl;
+    die = true;
+  }
+
+  // nothing to share without a budget
+  if (opt::auto_threads && opt::nthreads < 1) {
+    std::cerr << "ERROR: --auto-threads shares the -t threads, so needs -t 1 or more" << std::endl;
+    die = true;
+  }
+
   // dont stop the run for bad bams for quality checking only
   //opt::perc_limit = opt::qc_only ? 101 : opt::perc_limit;
 
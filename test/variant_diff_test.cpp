@@ -0,0 +1,1060 @@
+// Differential tests: every optimized mode of variant must write the same
+// reads, with the same -q stats and read counts, as the plain whole-file walk
+// it replaces. Modes that change which reads go together or how they are
+// written are checked against what the plain run's decisions imply.
+// Inputs and rule scripts are random, from a fixed seed per round, and the
+// variant binary is run as a user would. Set VARIANT to its path if it isn't
+// ../src/variant
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "htslib/sam.h"
+#include "htslib/kstring.h"
+
+static const int NUM_ROUNDS = 8;
+
+static const char* CONTIGS[] = { "chr1", "chr2", "chr3" };
+static const int32_t CONTIG_LEN[] = { 200000, 150000, 100000 };
+static const int NUM_CONTIGS = 3;
+
+static const int32_t READ_LEN = 100;
+
+// one read of a random input, before it's packed into a bam1_t
+struct TestRead {
+  std::string qname;
+  uint16_t flag = 0;
+  int32_t tid = -1, pos = -1, mtid = -1, mpos = -1, isize = 0;
+  uint8_t mapq = 0;
+  std::vector<uint32_t> cigar;
+  std::string seq, qual, rg;
+  int nm = 0;
+};
+
+// scratch directory, removed at the end of a round
+struct TempDir {
+  std::string path;
+  TempDir() {
+    char tmpl[] = "/tmp/variant_diff_XXXXXX";
+    path = mkdtemp(tmpl) ? tmpl : "";
+    BOOST_REQUIRE(!path.empty());
+  }
+  ~TempDir() { std::system(("rm -rf " + path).c_str()); }
+  std::string operator()(const std::string& name) const { return path + "/" + name; }
+};
+
+static std::string variant_bin() {
+  const char* v = getenv("VARIANT");
+  return v && *v ? v : "../src/variant";
+}
+
+static bool run_variant(const std::string& args) {
+  std::string cmd = variant_bin() + " " + args + " 2>/dev/null";
+  return std::system(cmd.c_str()) == 0;
+}
+
+// run variant with the size of the files it writes limited to max_kb, so that
+// it is killed part way through writing the output, as by a crash
+static bool run_variant_until(const std::string& args, long max_kb) {
+  std::string cmd = "ulimit -f " + std::to_string(max_kb) + "; " + variant_bin() + " " + args + " 2>/dev/null";
+  return std::system(cmd.c_str()) == 0;
+}
+
+static long file_size(const std::string& fn) {
+  std::ifstream in(fn, std::ios::binary | std::ios::ate);
+  return in ? (long)in.tellg() : -1;
+}
+
+static std::string slurp(const std::string& fn) {
+  std::ifstream in(fn);
+  std::stringstream ss;
+  ss << in.rdbuf();
+  return ss.str();
+}
+
+// the ReadCount of a run, from the last progress line that -v prints:
+// "Read <total> at <chr>:<pos>. Kept <keep> (<percent>%)"
+struct RunCounts {
+  long total = -1, keep = -1;
+};
+
+// a count as printed, with thousands separators
+static long parse_count(std::string s) {
+  s.erase(std::remove(s.begin(), s.end(), ','), s.end());
+  return s.empty() ? -1 : std::atol(s.c_str());
+}
+
+// run variant with -v, and return the counts of its last progress line
+static RunCounts run_variant_counts(const std::string& args, const std::string& log) {
+
+  RunCounts c;
+  std::string cmd = variant_bin() + " " + args + " -v 2>" + log;
+  if (std::system(cmd.c_str()) != 0)
+    return c;
+
+  std::ifstream in(log);
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.compare(0, 5, "Read ") != 0)
+      continue;
+    std::stringstream ss(line);
+    std::string word, total, keep;
+    while (ss >> word) {
+      if (word == "Read")
+	ss >> total;
+      else if (word == "Kept")
+	ss >> keep;
+    }
+    c.total = parse_count(total);
+    c.keep = parse_count(keep);
+  }
+  return c;
+}
+
+// a random CIGAR of READ_LEN query bases, mostly plain matches
+static std::vector<uint32_t> random_cigar(std::mt19937& rng) {
+
+  std::vector<uint32_t> c;
+  int r = rng() % 10;
+  if (r < 6) {
+    c.push_back(bam_cigar_gen(READ_LEN, BAM_CMATCH));
+  } else if (r < 8) { // clipped
+    int clip = 5 + rng() % 30;
+    bool hard = rng() % 3 == 0;
+    c.push_back(bam_cigar_gen(clip, hard ? BAM_CHARD_CLIP : BAM_CSOFT_CLIP));
+    c.push_back(bam_cigar_gen(READ_LEN - (hard ? 0 : clip), BAM_CMATCH));
+  } else { // indel
+    int a = 20 + rng() % 50, len = 1 + rng() % 10;
+    bool ins = rng() % 2;
+    c.push_back(bam_cigar_gen(a, BAM_CMATCH));
+    c.push_back(bam_cigar_gen(len, ins ? BAM_CINS : BAM_CDEL));
+    c.push_back(bam_cigar_gen(READ_LEN - a - (ins ? len : 0), BAM_CMATCH));
+  }
+  return c;
+}
+
+static int32_t ref_len(const std::vector<uint32_t>& c) {
+  int32_t l = 0;
+  for (auto& o : c)
+    if (bam_cigar_type(bam_cigar_op(o)) & 2)
+      l += bam_cigar_oplen(o);
+  return l;
+}
+
+static void random_bases(std::mt19937& rng, TestRead& r) {
+
+  const char* ACGTN = "ACGTN";
+  int len = 0;
+  for (auto& o : r.cigar)
+    if (bam_cigar_type(bam_cigar_op(o)) & 1)
+      len += bam_cigar_oplen(o);
+  if (r.cigar.empty())
+    len = READ_LEN;
+
+  r.seq.resize(len);
+  r.qual.resize(len);
+  int tail = rng() % 4 == 0 ? rng() % 30 : 0; // low quality end
+  for (int i = 0; i < len; ++i) {
+    r.seq[i] = ACGTN[rng() % 100 == 0 ? 4 : rng() % 4];
+    r.qual[i] = i >= len - tail ? 2 + rng() % 8 : 10 + rng() % 31;
+  }
+}
+
+// names of 7 characters, so that the CIGAR after the name stays 4-byte aligned
+static std::string qname(char prefix, int i) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%c%06d", prefix, i % 1000000);
+  return buf;
+}
+
+// a random pair. Mapped mates are placed near each other, or on another contig
+static void random_pair(std::mt19937& rng, int i, std::vector<TestRead>& reads) {
+
+  TestRead a, b;
+  a.qname = b.qname = qname('r', i);
+  a.rg = b.rg = rng() % 2 ? "rgA" : "rgB";
+
+  bool dup = rng() % 20 == 0, qcfail = rng() % 30 == 0;
+  bool a_unmapped = rng() % 20 == 0, b_unmapped = rng() % 20 == 0;
+
+  a.tid = rng() % NUM_CONTIGS;
+  a.pos = rng() % (CONTIG_LEN[a.tid] - 2000);
+  b.tid = rng() % 25 == 0 ? (int)(rng() % NUM_CONTIGS) : a.tid;
+  b.pos = b.tid == a.tid ? a.pos + 100 + rng() % 600 : rng() % (CONTIG_LEN[b.tid] - 2000);
+
+  // an unmapped read sits at its mate
+  if (a_unmapped && !b_unmapped) { a.tid = b.tid; a.pos = b.pos; }
+  if (b_unmapped && !a_unmapped) { b.tid = a.tid; b.pos = a.pos; }
+
+  TestRead* r[2] = { &a, &b };
+  bool unmapped[2] = { a_unmapped, b_unmapped };
+  for (int k = 0; k < 2; ++k) {
+    TestRead& x = *r[k];
+    TestRead& m = *r[1 - k];
+    x.flag = BAM_FPAIRED | (k ? BAM_FREAD2 : BAM_FREAD1) | (k ? BAM_FREVERSE : BAM_FMREVERSE);
+    if (dup) x.flag |= BAM_FDUP;
+    if (qcfail) x.flag |= BAM_FQCFAIL;
+    if (unmapped[k]) x.flag |= BAM_FUNMAP;
+    if (unmapped[1 - k]) x.flag |= BAM_FMUNMAP;
+    if (!a_unmapped && !b_unmapped && a.tid == b.tid) x.flag |= BAM_FPROPER_PAIR;
+    if (!unmapped[k]) {
+      x.cigar = random_cigar(rng);
+      x.mapq = rng() % 61;
+      x.nm = rng() % 6;
+    }
+    x.mtid = m.tid;
+    x.mpos = m.pos;
+    random_bases(rng, x);
+  }
+
+  if (!a_unmapped && !b_unmapped && a.tid == b.tid) {
+    int32_t span = b.pos + ref_len(b.cigar) - a.pos;
+    a.isize = span;
+    b.isize = -span;
+  }
+
+  reads.push_back(a);
+  reads.push_back(b);
+
+  // the odd secondary or supplementary alignment of a
+  if (!a_unmapped && rng() % 25 == 0) {
+    TestRead s = a;
+    s.flag |= rng() % 2 ? BAM_FSECONDARY : BAM_FSUPPLEMENTARY;
+    s.pos = rng() % (CONTIG_LEN[s.tid] - 2000);
+    s.cigar = random_cigar(rng);
+    random_bases(rng, s);
+    reads.push_back(s);
+  }
+}
+
+// unmapped pairs, with no position
+static void random_unplaced_pair(std::mt19937& rng, int i, std::vector<TestRead>& reads) {
+  for (int k = 0; k < 2; ++k) {
+    TestRead x;
+    x.qname = qname('u', i);
+    x.rg = rng() % 2 ? "rgA" : "rgB";
+    x.flag = BAM_FPAIRED | BAM_FUNMAP | BAM_FMUNMAP | (k ? BAM_FREAD2 : BAM_FREAD1);
+    if (rng() % 20 == 0)
+      x.flag |= BAM_FQCFAIL;
+    random_bases(rng, x);
+    reads.push_back(x);
+  }
+}
+
+static void pack(const TestRead& t, bam1_t* b) {
+
+  std::string data(t.qname.c_str(), t.qname.size() + 1);
+  data.append((const char*)t.cigar.data(), t.cigar.size() * 4);
+  std::string seq((t.seq.size() + 1) / 2, '\0');
+  for (size_t i = 0; i < t.seq.size(); ++i)
+    seq[i / 2] |= seq_nt16_table[(int)t.seq[i]] << ((i % 2) ? 0 : 4);
+  data += seq + t.qual;
+  data += "RGZ" + t.rg + std::string(1, '\0');
+  if (!(t.flag & BAM_FUNMAP)) {
+    data += "NMC";
+    data += (char)t.nm;
+  }
+
+  b->core.tid = t.tid;
+  b->core.pos = t.pos;
+  b->core.bin = hts_reg2bin(t.pos < 0 ? 0 : t.pos, t.pos < 0 ? 1 : t.pos + std::max(ref_len(t.cigar), 1), 14, 5);
+  b->core.qual = t.mapq;
+  b->core.l_qname = t.qname.size() + 1;
+  b->core.flag = t.flag;
+  b->core.n_cigar = t.cigar.size();
+  b->core.l_qseq = t.seq.size();
+  b->core.mtid = t.mtid;
+  b->core.mpos = t.mpos;
+  b->core.isize = t.isize;
+
+  b->data = (uint8_t*)realloc(b->data, data.size());
+  b->m_data = data.size();
+  b->l_data = data.size();
+  memcpy(b->data, data.data(), data.size());
+}
+
+// write the reads as a sorted, indexed BAM. The header is read back from
+// a SAM file, which works the same on every htslib version
+static void write_bam(std::vector<TestRead> reads, const std::string& fn, const std::string& header_fn) {
+
+  std::stable_sort(reads.begin(), reads.end(), [](const TestRead& x, const TestRead& y) {
+      uint32_t tx = x.tid, ty = y.tid; // unplaced (-1) last
+      return tx != ty ? tx < ty : x.pos < y.pos;
+    });
+
+  std::string text = "@HD\tVN:1.4\tSO:coordinate\n";
+  for (int i = 0; i < NUM_CONTIGS; ++i)
+    text += "@SQ\tSN:" + std::string(CONTIGS[i]) + "\tLN:" + std::to_string(CONTIG_LEN[i]) + "\n";
+  text += "@RG\tID:rgA\n@RG\tID:rgB\n";
+
+  std::ofstream(header_fn) << text;
+  htsFile* hp = hts_open(header_fn.c_str(), "r");
+  BOOST_REQUIRE(hp);
+  bam_hdr_t* hdr = sam_hdr_read(hp);
+  hts_close(hp);
+  BOOST_REQUIRE(hdr);
+
+  htsFile* fp = hts_open(fn.c_str(), "wb");
+  BOOST_REQUIRE(fp);
+  BOOST_REQUIRE(sam_hdr_write(fp, hdr) == 0);
+
+  bam1_t* b = bam_init1();
+  for (const auto& r : reads) {
+    pack(r, b);
+    BOOST_REQUIRE(sam_write1(fp, hdr, b) >= 0);
+  }
+  bam_destroy1(b);
+  bam_hdr_destroy(hdr);
+  hts_close(fp);
+
+  BOOST_REQUIRE(sam_index_build(fn.c_str(), 0) == 0);
+}
+
+// a BAM of random pairs
+static void write_random_bam(std::mt19937& rng, const std::string& fn, const std::string& header_fn) {
+
+  std::vector<TestRead> reads;
+  int num_pairs = 1500 + rng() % 1500;
+  for (int i = 0; i < num_pairs; ++i)
+    random_pair(rng, i, reads);
+  int num_unplaced = 50 + rng() % 100;
+  for (int i = 0; i < num_unplaced; ++i)
+    random_unplaced_pair(rng, i, reads);
+
+  write_bam(reads, fn, header_fn);
+}
+
+// a random samtools-style region
+static std::string random_region(std::mt19937& rng) {
+  int c = rng() % NUM_CONTIGS;
+  int32_t s = 1 + rng() % (CONTIG_LEN[c] - 20000);
+  return std::string(CONTIGS[c]) + ":" + std::to_string(s) + "-" + std::to_string(s + 1000 + rng() % 15000);
+}
+
+// "key" : [a, b], in either order (reversed rejects the range)
+static std::string random_range(std::mt19937& rng, const std::string& key, int lo, int hi) {
+  int a = lo + rng() % (hi - lo + 1), b = lo + rng() % (hi - lo + 1);
+  if (a > b && rng() % 3)
+    std::swap(a, b);
+  return "\"" + key + "\" : [" + std::to_string(a) + "," + std::to_string(b) + "]";
+}
+
+static std::string random_condition(std::mt19937& rng) {
+
+  static const char* FLAGS[] = { "duplicate", "qcfail", "hardclip", "supplementary", "fwd_strand",
+				 "rev_strand", "mapped", "mate_mapped", "paired" };
+  switch (rng() % 13) {
+  case 0: return random_range(rng, "mapq", 0, 60);
+  case 1: return random_range(rng, "len", 0, 100);
+  case 2: return random_range(rng, "phred", 0, 40);
+  case 3: return random_range(rng, "clip", 0, 40);
+  case 4: return random_range(rng, "nm", 0, 6);
+  case 5: return random_range(rng, "nbases", 0, 3);
+  case 6: return random_range(rng, "ins", 0, 10);
+  case 7: return random_range(rng, "del", 0, 10);
+  case 8: return random_range(rng, "isize", 0, 1000);
+  case 9: return "\"rg\" : \"" + std::string(rng() % 2 ? "rgA" : "rgB") + "\"";
+  case 10: return "\"subsample\" : 0." + std::to_string(1 + rng() % 9);
+  default: return "\"" + std::string(FLAGS[rng() % 9]) + "\" : " + (rng() % 2 ? "true" : "false");
+  }
+}
+
+// a random rules script of a few region groups, each with a few rules
+static std::string random_rules(std::mt19937& rng) {
+
+  std::stringstream ss;
+  ss << "{";
+  int groups = 1 + rng() % 3;
+  for (int g = 0; g < groups; ++g) {
+    ss << (g ? ", " : "") << "\"g" << g << "\" : {";
+    std::vector<std::string> fields;
+    bool region = rng() % 2;
+    if (region) {
+      fields.push_back("\"region\" : \"" + random_region(rng) + "\"");
+      if (rng() % 3 == 0)
+	fields.push_back("\"pad\" : " + std::to_string(rng() % 1000));
+      if (rng() % 3 == 0)
+	fields.push_back("\"matelinked\" : true");
+      if (rng() % 5 == 0)
+	fields.push_back("\"exclude\" : true");
+    }
+    if (!region || rng() % 3) {
+      std::string rules = "\"rules\" : [";
+      int n = 1 + rng() % 3;
+      for (int i = 0; i < n; ++i) {
+	rules += i ? ", {" : "{";
+	int c = 1 + rng() % 3;
+	for (int j = 0; j < c; ++j)
+	  rules += (j ? ", " : "") + random_condition(rng);
+	rules += "}";
+      }
+      fields.push_back(rules + "]");
+    }
+    for (size_t i = 0; i < fields.size(); ++i)
+      ss << (i ? ", " : "") << fields[i];
+    ss << "}";
+  }
+  ss << "}";
+  return ss.str();
+}
+
+// well separated -k regions, at least 1 kb wide so the walker doesn't pad them
+static void write_random_bed(std::mt19937& rng, const std::string& fn) {
+  std::ofstream out(fn);
+  for (int c = 0; c < NUM_CONTIGS; ++c)
+    for (int32_t s = rng() % 5000; s + 3000 < CONTIG_LEN[c]; s += 5000 + rng() % 20000)
+      out << CONTIGS[c] << "\t" << s << "\t" << s + 1000 + rng() % 2000 << "\n";
+}
+
+// narrow -k regions a few hundred bases apart, so they overlap once the
+// walker pads them to 1 kb. Not sorted, as a hand-written BED may not be
+static void write_small_bed(std::mt19937& rng, const std::string& fn) {
+  std::vector<std::string> lines;
+  for (int c = 0; c < NUM_CONTIGS; ++c)
+    for (int32_t s = rng() % 5000; s + 3000 < CONTIG_LEN[c]; s += rng() % 3 ? 200 + rng() % 1500 : 10000 + rng() % 20000)
+      lines.push_back(std::string(CONTIGS[c]) + "\t" + std::to_string(s) + "\t" + std::to_string(s + 1 + rng() % 500));
+  std::shuffle(lines.begin(), lines.end(), rng);
+  std::ofstream out(fn);
+  for (const auto& l : lines)
+    out << l << "\n";
+}
+
+// write the reads of a BAM grouped by name, as samtools collate would, with
+// the header no longer claiming coordinate order
+static void write_collated(const std::string& in, const std::string& out, const std::string& header_fn) {
+
+  htsFile* fp = hts_open(in.c_str(), "r");
+  BOOST_REQUIRE(fp);
+  bam_hdr_t* hdr = sam_hdr_read(fp);
+  std::vector<bam1_t*> reads;
+  for (bam1_t* b = bam_init1(); sam_read1(fp, hdr, b) >= 0; b = bam_init1())
+    reads.push_back(b);
+  hts_close(fp);
+
+  std::stable_sort(reads.begin(), reads.end(), [](const bam1_t* x, const bam1_t* y) {
+      return strcmp(bam_get_qname(x), bam_get_qname(y)) < 0;
+    });
+
+  std::string text(hdr->text, hdr->l_text);
+  size_t so = text.find("SO:coordinate");
+  BOOST_REQUIRE(so != std::string::npos);
+  text.replace(so, strlen("SO:coordinate"), "SO:unsorted\tGO:query");
+  bam_hdr_destroy(hdr);
+
+  std::ofstream(header_fn) << text;
+  htsFile* hp = hts_open(header_fn.c_str(), "r");
+  BOOST_REQUIRE(hp);
+  hdr = sam_hdr_read(hp);
+  hts_close(hp);
+  BOOST_REQUIRE(hdr);
+
+  fp = hts_open(out.c_str(), "wb");
+  BOOST_REQUIRE(fp);
+  BOOST_REQUIRE(sam_hdr_write(fp, hdr) == 0);
+  for (bam1_t* b : reads) {
+    BOOST_REQUIRE(sam_write1(fp, hdr, b) >= 0);
+    bam_destroy1(b);
+  }
+  bam_hdr_destroy(hdr);
+  hts_close(fp);
+}
+
+// a tab-separated field of a SAM line
+static std::string sam_field(const std::string& line, int i) {
+  std::stringstream ss(line);
+  std::string f;
+  for (int k = 0; k <= i && std::getline(ss, f, '\t'); ++k)
+    ;
+  return f;
+}
+
+// the reads of a BAM/SAM, as SAM lines in file order
+static std::vector<std::string> read_records(const std::string& fn) {
+
+  std::vector<std::string> out;
+  htsFile* fp = hts_open(fn.c_str(), "r");
+  BOOST_REQUIRE_MESSAGE(fp, "could not open " << fn);
+  bam_hdr_t* hdr = sam_hdr_read(fp);
+  bam1_t* b = bam_init1();
+  kstring_t s = { 0, 0, NULL };
+  while (sam_read1(fp, hdr, b) >= 0) {
+    s.l = 0;
+    sam_format1(hdr, b, &s);
+    out.push_back(std::string(s.s, s.l));
+  }
+  free(s.s);
+  bam_destroy1(b);
+  bam_hdr_destroy(hdr);
+  hts_close(fp);
+  return out;
+}
+
+// everything a round needs: a random BAM, a random script and -k regions
+struct Round {
+  TempDir dir;
+  std::string bam, rules, bed;
+  explicit Round(int seed) {
+    std::mt19937 rng(seed);
+    bam = dir("in.bam");
+    rules = dir("rules.json");
+    bed = dir("regions.bed");
+    write_random_bam(rng, bam, dir("header.sam"));
+    std::ofstream(rules) << random_rules(rng);
+    write_random_bed(rng, bed);
+  }
+  // options shared by every run of the round
+  std::string args(const std::string& out) const {
+    return bam + " -r " + rules + " -b -o " + out;
+  }
+};
+
+static void check_same(const std::vector<std::string>& expected, const std::vector<std::string>& got,
+		       const std::string& mode, int seed) {
+  BOOST_CHECK_MESSAGE(expected.size() == got.size(), mode << " (seed " << seed << "): " << got.size()
+		      << " reads, expected " << expected.size());
+  size_t i = 0;
+  while (i < std::min(expected.size(), got.size()) && expected[i] == got[i])
+    ++i;
+  BOOST_CHECK_MESSAGE(i == expected.size() && i == got.size(), mode << " (seed " << seed << "): first difference at read " << i);
+}
+
+// the ReadCount of each file of a --batch run, from its report on stdout
+static std::vector<RunCounts> read_batch_counts(const std::string& fn) {
+
+  std::vector<RunCounts> out;
+  std::ifstream in(fn);
+  std::string line;
+  std::getline(in, line); // column names
+  while (std::getline(in, line)) {
+    std::stringstream ss(line);
+    std::string input, output, status;
+    RunCounts c;
+    ss >> input >> output >> status >> c.total >> c.keep;
+    out.push_back(c);
+  }
+  return out;
+}
+
+// the same ReadCount. Modes that skip reads which can't pass only match on the kept reads
+static void check_counts(const RunCounts& expected, const RunCounts& got, bool same_total,
+			 const std::string& mode, int seed) {
+  BOOST_CHECK_MESSAGE(got.keep >= 0, mode << " (seed " << seed << "): no read counts");
+  BOOST_CHECK_MESSAGE(expected.keep == got.keep, mode << " (seed " << seed << "): kept " << got.keep
+		      << " reads, expected " << expected.keep);
+  if (same_total)
+    BOOST_CHECK_MESSAGE(expected.total == got.total, mode << " (seed " << seed << "): read " << got.total
+			<< " reads, expected " << expected.total);
+}
+
+BOOST_AUTO_TEST_CASE( planned_regions_match_full_scan ) {
+
+  for (int seed = 1; seed <= NUM_ROUNDS; ++seed) {
+    Round t(seed);
+
+    // -q needs every read, so it turns the planner off
+    RunCounts ref = run_variant_counts(t.args(t.dir("ref.bam")) + " -q " + t.dir("ref.qc"), t.dir("ref.log"));
+    RunCounts plan = run_variant_counts(t.args(t.dir("plan.bam")), t.dir("plan.log"));
+    BOOST_REQUIRE(ref.total >= 0 && plan.total >= 0);
+
+    check_same(read_records(t.dir("ref.bam")), read_records(t.dir("plan.bam")), "region planner", seed);
+    check_counts(ref, plan, false, "region planner", seed);
+
+    // -m counts the coverage of the reads that fail too
+    std::string m = " -m " + std::to_string(1 + seed % 3);
+    BOOST_REQUIRE(run_variant(t.args(t.dir("ref_m.bam")) + m + " -q " + t.dir("ref_m.qc")));
+    BOOST_REQUIRE(run_variant(t.args(t.dir("plan_m.bam")) + m));
+    check_same(read_records(t.dir("ref_m.bam")), read_records(t.dir("plan_m.bam")), "region planner -m", seed);
+  }
+}
+
+BOOST_AUTO_TEST_CASE( coalesced_regions_match_per_region ) {
+
+  for (int seed = 1; seed <= NUM_ROUNDS; ++seed) {
+    Round t(seed);
+    std::string k = " -k " + t.bed + " -q ";
+
+    RunCounts ref_rc = run_variant_counts(t.args(t.dir("ref.bam")) + k + t.dir("ref.qc") + " --region-gap -1", t.dir("ref.log"));
+    RunCounts span_rc = run_variant_counts(t.args(t.dir("span.bam")) + k + t.dir("span.qc"), t.dir("span.log"));
+    BOOST_REQUIRE(ref_rc.total >= 0 && span_rc.total >= 0);
+    BOOST_REQUIRE(run_variant(t.args(t.dir("wide.bam")) + k + t.dir("wide.qc") + " --region-gap 100000000"));
+    BOOST_REQUIRE(run_variant(t.args(t.dir("pre.bam")) + k + t.dir("pre.qc") + " --region-gap -1 --prefetch 1"));
+
+    std::vector<std::string> ref = read_records(t.dir("ref.bam"));
+    check_same(ref, read_records(t.dir("span.bam")), "coalesced regions", seed);
+    check_same(ref, read_records(t.dir("wide.bam")), "one span per contig", seed);
+    check_same(ref, read_records(t.dir("pre.bam")), "prefetch", seed);
+
+    std::string qc = slurp(t.dir("ref.qc"));
+    BOOST_CHECK_MESSAGE(qc == slurp(t.dir("span.qc")), "coalesced regions stats (seed " << seed << ")");
+    BOOST_CHECK_MESSAGE(qc == slurp(t.dir("wide.qc")), "one span per contig stats (seed " << seed << ")");
+    BOOST_CHECK_MESSAGE(qc == slurp(t.dir("pre.qc")), "prefetch stats (seed " << seed << ")");
+    check_counts(ref_rc, span_rc, true, "coalesced regions", seed);
+
+    // the -m windows see the same reads in the same order
+    std::string m = " -m " + std::to_string(1 + seed % 3) + k;
+    BOOST_REQUIRE(run_variant(t.args(t.dir("ref_m.bam")) + m + t.dir("ref_m.qc") + " --region-gap -1"));
+    BOOST_REQUIRE(run_variant(t.args(t.dir("span_m.bam")) + m + t.dir("span_m.qc")));
+    check_same(read_records(t.dir("ref_m.bam")), read_records(t.dir("span_m.bam")), "coalesced regions -m", seed);
+    BOOST_CHECK_MESSAGE(slurp(t.dir("ref_m.qc")) == slurp(t.dir("span_m.qc")), "coalesced regions -m stats (seed " << seed << ")");
+  }
+}
+
+BOOST_AUTO_TEST_CASE( unmapped_fast_path_matches_full_scan ) {
+
+  for (int seed = 1; seed <= NUM_ROUNDS; ++seed) {
+    Round t(seed);
+
+    BOOST_REQUIRE(run_variant(t.args(t.dir("ref.bam"))));
+    RunCounts un = run_variant_counts(t.args(t.dir("un.bam")) + " -k UN", t.dir("un.log"));
+    RunCounts un3 = run_variant_counts(t.args(t.dir("un3.bam")) + " -k UN -t 3", t.dir("un3.log"));
+    BOOST_REQUIRE(un.total >= 0 && un3.total >= 0);
+
+    // the unplaced reads kept by the full scan
+    std::vector<std::string> ref;
+    for (const auto& r : read_records(t.dir("ref.bam"))) {
+      std::stringstream ss(r);
+      std::string qname, flag, chr;
+      ss >> qname >> flag >> chr;
+      if (chr == "*")
+	ref.push_back(r);
+    }
+
+    check_same(ref, read_records(t.dir("un.bam")), "-k UN", seed);
+    check_same(ref, read_records(t.dir("un3.bam")), "-k UN -t 3", seed);
+    check_counts(un, un3, true, "-k UN -t 3", seed);
+
+    // -m takes the main loop, as it did before the fast path. A negative -m
+    // is a least coverage, which reads with no position don't have
+    BOOST_REQUIRE(run_variant(t.args(t.dir("ref_m.bam")) + " -m -1"));
+    BOOST_REQUIRE(run_variant(t.args(t.dir("un_m.bam")) + " -k UN -m -1"));
+    std::vector<std::string> ref_m;
+    for (const auto& r : read_records(t.dir("ref_m.bam")))
+      if (sam_field(r, 2) == "*")
+	ref_m.push_back(r);
+    check_same(ref_m, read_records(t.dir("un_m.bam")), "-k UN -m -1", seed);
+    BOOST_CHECK_MESSAGE(un.keep == (long)ref.size(), "-k UN (seed " << seed << "): counted " << un.keep
+			<< " kept reads, wrote " << ref.size());
+  }
+}
+
+BOOST_AUTO_TEST_CASE( auto_threads_match_one_thread ) {
+
+  for (int seed = 1; seed <= NUM_ROUNDS; ++seed) {
+    Round t(seed);
+
+    // -m too, since the batches are evaluated ahead of the coverage windows
+    std::string m = " -m " + std::to_string(1 + seed % 3) + " -q ";
+    RunCounts ref = run_variant_counts(t.args(t.dir("ref.bam")) + m + t.dir("ref.qc"), t.dir("ref.log"));
+    RunCounts aut = run_variant_counts(t.args(t.dir("auto.bam")) + m + t.dir("auto.qc") + " --auto-threads -t 3", t.dir("auto.log"));
+    BOOST_REQUIRE(ref.total >= 0 && aut.total >= 0);
+    BOOST_REQUIRE(run_variant(t.args(t.dir("auto_k.bam")) + m + t.dir("auto_k.qc") + " --auto-threads -t 2 -k " + t.bed));
+    BOOST_REQUIRE(run_variant(t.args(t.dir("ref_k.bam")) + m + t.dir("ref_k.qc") + " -k " + t.bed));
+
+    check_same(read_records(t.dir("ref.bam")), read_records(t.dir("auto.bam")), "--auto-threads", seed);
+    check_same(read_records(t.dir("ref_k.bam")), read_records(t.dir("auto_k.bam")), "--auto-threads -k", seed);
+    BOOST_CHECK_MESSAGE(slurp(t.dir("ref.qc")) == slurp(t.dir("auto.qc")), "--auto-threads stats (seed " << seed << ")");
+    BOOST_CHECK_MESSAGE(slurp(t.dir("ref_k.qc")) == slurp(t.dir("auto_k.qc")), "--auto-threads -k stats (seed " << seed << ")");
+    check_counts(ref, aut, true, "--auto-threads", seed);
+  }
+}
+
+BOOST_AUTO_TEST_CASE( batch_matches_single_runs ) {
+
+  for (int seed = 1; seed <= NUM_ROUNDS; seed += 2) {
+    Round t(seed), u(seed + 1);
+
+    // u's script is replaced by t's, since a batch has one script
+    RunCounts ref[2] = {
+      run_variant_counts(t.args(t.dir("ref.bam")) + " -q " + t.dir("ref.qc"), t.dir("ref.log")),
+      run_variant_counts(u.bam + " -r " + t.rules + " -b -o " + u.dir("ref.bam") + " -q " + u.dir("ref.qc"), u.dir("ref.log"))
+    };
+    BOOST_REQUIRE(ref[0].total >= 0 && ref[1].total >= 0);
+
+    std::ofstream(t.dir("manifest")) << t.bam << " " << t.dir("batch.bam") << " " << t.dir("batch.qc") << "\n"
+				     << u.bam << " " << u.dir("batch.bam") << " " << u.dir("batch.qc") << "\n";
+    BOOST_REQUIRE(run_variant("--batch " + t.dir("manifest") + " --batch-jobs 2 -r " + t.rules + " -b > " + t.dir("batch.tsv")));
+    std::vector<RunCounts> batch = read_batch_counts(t.dir("batch.tsv"));
+    BOOST_REQUIRE_EQUAL(batch.size(), 2u);
+
+    const Round* rounds[2] = { &t, &u };
+    for (int i = 0; i < 2; ++i) {
+      const Round* r = rounds[i];
+      check_same(read_records(r->dir("ref.bam")), read_records(r->dir("batch.bam")), "--batch", seed);
+      BOOST_CHECK_MESSAGE(slurp(r->dir("ref.qc")) == slurp(r->dir("batch.qc")), "--batch stats (seed " << seed << ")");
+      check_counts(ref[i], batch[i], true, "--batch", seed);
+    }
+
+    // with --link-pairs the mates of kept reads can be anywhere, so a batch
+    // can't read only the rule regions either
+    BOOST_REQUIRE(run_variant(t.args(t.dir("lp.bam")) + " --link-pairs"));
+    BOOST_REQUIRE(run_variant(u.bam + " -r " + t.rules + " -b -o " + u.dir("lp.bam") + " --link-pairs"));
+    std::ofstream(t.dir("manifest_lp")) << t.bam << " " << t.dir("batch_lp.bam") << "\n"
+					<< u.bam << " " << u.dir("batch_lp.bam") << "\n";
+    BOOST_REQUIRE(run_variant("--batch " + t.dir("manifest_lp") + " --batch-jobs 2 -r " + t.rules + " -b --link-pairs"));
+
+    for (const Round* r : { &t, &u })
+      check_same(read_records(r->dir("lp.bam")), read_records(r->dir("batch_lp.bam")), "--batch --link-pairs", seed);
+  }
+}
+
+BOOST_AUTO_TEST_CASE( checkpoints_and_index_match_single_run ) {
+
+  for (int seed = 1; seed <= NUM_ROUNDS; ++seed) {
+    Round t(seed);
+
+    RunCounts ref_rc = run_variant_counts(t.args(t.dir("ref.bam")) + " -q " + t.dir("ref.qc"), t.dir("ref.log"));
+    RunCounts ckpt_rc = run_variant_counts(t.args(t.dir("ckpt.bam")) + " -q " + t.dir("ckpt.qc") + " --checkpoint 500", t.dir("ckpt.log"));
+    BOOST_REQUIRE(ref_rc.total >= 0 && ckpt_rc.total >= 0);
+    BOOST_REQUIRE(run_variant(t.args(t.dir("idx.bam")) + " -q " + t.dir("idx.qc") + " --write-index"));
+
+    std::vector<std::string> ref = read_records(t.dir("ref.bam"));
+    check_same(ref, read_records(t.dir("ckpt.bam")), "--checkpoint", seed);
+    check_same(ref, read_records(t.dir("idx.bam")), "--write-index", seed);
+
+    std::string qc = slurp(t.dir("ref.qc"));
+    BOOST_CHECK_MESSAGE(qc == slurp(t.dir("ckpt.qc")), "--checkpoint stats (seed " << seed << ")");
+    BOOST_CHECK_MESSAGE(qc == slurp(t.dir("idx.qc")), "--write-index stats (seed " << seed << ")");
+    check_counts(ref_rc, ckpt_rc, true, "--checkpoint", seed);
+  }
+}
+
+// true if the SAM lines are in coordinate order, with no read twice
+static bool sorted_once(const std::vector<std::string>& reads) {
+  std::string last_chr;
+  long last_pos = -1;
+  for (const auto& r : reads) {
+    std::stringstream ss(r);
+    std::string qname, flag, chr;
+    long pos;
+    ss >> qname >> flag >> chr >> pos;
+    if (chr == last_chr && pos < last_pos)
+      return false;
+    last_chr = chr;
+    last_pos = pos;
+  }
+  std::vector<std::string> seen = reads;
+  std::sort(seen.begin(), seen.end());
+  return std::adjacent_find(seen.begin(), seen.end()) == seen.end();
+}
+
+BOOST_AUTO_TEST_CASE( small_regions_are_indexed_once ) {
+
+  for (int seed = 1; seed <= NUM_ROUNDS; ++seed) {
+    Round t(seed);
+    std::mt19937 rng(seed);
+    std::string bed = t.dir("small.bed");
+    write_small_bed(rng, bed);
+    std::string k = " -k " + bed;
+
+    // one pass per region writes the reads of overlapping regions twice
+    BOOST_REQUIRE(run_variant(t.args(t.dir("ref.bam")) + k + " --region-gap -1"));
+    BOOST_REQUIRE(run_variant(t.args(t.dir("idx.bam")) + k + " --region-gap -1 --write-index"));
+    BOOST_REQUIRE(run_variant(t.args(t.dir("span.bam")) + k + " --write-index"));
+
+    std::vector<std::string> ref = read_records(t.dir("ref.bam"));
+    std::sort(ref.begin(), ref.end());
+    ref.erase(std::unique(ref.begin(), ref.end()), ref.end());
+
+    for (const char* mode : { "idx", "span" }) {
+      std::string out = t.dir(std::string(mode) + ".bam");
+      std::vector<std::string> got = read_records(out);
+      BOOST_CHECK_MESSAGE(sorted_once(got), mode << " --write-index (seed " << seed << "): reads out of order or repeated");
+      std::sort(got.begin(), got.end());
+      check_same(ref, got, std::string(mode) + " --write-index, small regions", seed);
+
+      hts_idx_t* idx = hts_idx_load(out.c_str(), HTS_FMT_BAI);
+      BOOST_CHECK_MESSAGE(idx, mode << " --write-index (seed " << seed << "): no index");
+      if (idx)
+	hts_idx_destroy(idx);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE( resumed_runs_match_single_run ) {
+
+  int resumed = 0;
+  for (int seed = 1; seed <= NUM_ROUNDS; ++seed) {
+    Round t(seed);
+
+    // -m low enough that the coverage windows decide what is kept
+    std::string opts = " -m " + std::to_string(1 + seed % 2) + " --checkpoint 200 -q ";
+    RunCounts ref = run_variant_counts(t.args(t.dir("ref.bam")) + " -m " + std::to_string(1 + seed % 2) + " -q " + t.dir("ref.qc"),
+				       t.dir("ref.log"));
+    BOOST_REQUIRE(ref.total >= 0);
+
+    // stop the first run about half way through its output, then resume it
+    long kb = file_size(t.dir("ref.bam")) / 2048;
+    std::string args = t.args(t.dir("ckpt.bam")) + opts + t.dir("ckpt.qc");
+    if (kb < 8 || run_variant_until(args, kb) || file_size(t.dir("ckpt.bam.ckpt")) <= 0)
+      continue;
+    RunCounts res = run_variant_counts(args + " --resume", t.dir("resume.log"));
+    BOOST_REQUIRE(res.total >= 0);
+    ++resumed;
+
+    check_same(read_records(t.dir("ref.bam")), read_records(t.dir("ckpt.bam")), "-m --checkpoint --resume", seed);
+    BOOST_CHECK_MESSAGE(slurp(t.dir("ref.qc")) == slurp(t.dir("ckpt.qc")), "-m --resume stats (seed " << seed << ")");
+    check_counts(ref, res, true, "-m --resume", seed);
+  }
+
+  BOOST_CHECK_MESSAGE(resumed > 0, "no run was interrupted after a checkpoint");
+}
+
+BOOST_AUTO_TEST_CASE( linked_pairs_and_fragments_match_plain_rules ) {
+
+  for (int seed = 1; seed <= NUM_ROUNDS; ++seed) {
+    Round t(seed);
+
+    // the plain run decides each read on its own. Every read is either kept or rejected
+    RunCounts ref = run_variant_counts(t.args(t.dir("ref.bam")) + " --rejected " + t.dir("rej.bam"), t.dir("ref.log"));
+    BOOST_REQUIRE(ref.total >= 0);
+    std::vector<std::string> reads = read_records(t.dir("ref.bam"));
+    std::vector<char> pass(reads.size(), 1);
+    for (const auto& r : read_records(t.dir("rej.bam"))) {
+      reads.push_back(r);
+      pass.push_back(0);
+    }
+
+    // what passed, per name: any primary mate, any read, every read
+    std::map<std::string, bool> mate_pass, any_pass, all_pass;
+    for (size_t i = 0; i < reads.size(); ++i) {
+      std::string q = sam_field(reads[i], 0);
+      int flag = std::atoi(sam_field(reads[i], 1).c_str());
+      if ((flag & BAM_FPAIRED) && !(flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)))
+	mate_pass[q] = mate_pass[q] || pass[i];
+      any_pass[q] = any_pass[q] || pass[i];
+      all_pass[q] = (all_pass.count(q) ? all_pass[q] : true) && pass[i];
+    }
+
+    std::vector<std::string> linked, any, all;
+    for (size_t i = 0; i < reads.size(); ++i) {
+      std::string q = sam_field(reads[i], 0);
+      int flag = std::atoi(sam_field(reads[i], 1).c_str());
+      bool primary = (flag & BAM_FPAIRED) && !(flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY));
+      if (primary ? mate_pass[q] : pass[i])
+	linked.push_back(reads[i]);
+      if (any_pass[q])
+	any.push_back(reads[i]);
+      if (all_pass[q])
+	all.push_back(reads[i]);
+    }
+
+    // the outputs are in order of pairing, so compare them sorted
+    write_collated(t.bam, t.dir("coll.bam"), t.dir("coll_header.sam"));
+    std::string coll = t.dir("coll.bam") + " -r " + t.rules + " -b -o ";
+    struct { const char* mode; std::string out, args; std::vector<std::string>* expected; } runs[] = {
+      { "--link-pairs", t.dir("lp.bam"), t.args(t.dir("lp.bam")) + " --link-pairs", &linked },
+      { "--collated any", t.dir("any.bam"), coll + t.dir("any.bam") + " --collated any", &any },
+      { "--collated all", t.dir("all.bam"), coll + t.dir("all.bam") + " --collated all", &all },
+    };
+    for (auto& run : runs) {
+      RunCounts got = run_variant_counts(run.args, run.out + ".log");
+      BOOST_REQUIRE_MESSAGE(got.total >= 0, run.mode << " (seed " << seed << ") failed");
+
+      std::vector<std::string> kept = read_records(run.out);
+      std::sort(kept.begin(), kept.end());
+      std::sort(run.expected->begin(), run.expected->end());
+      check_same(*run.expected, kept, run.mode, seed);
+
+      RunCounts expected;
+      expected.total = ref.total;
+      expected.keep = run.expected->size();
+      check_counts(expected, got, true, run.mode, seed);
+    }
+  }
+}
+
+// a quality character binned as --bin-qualities illumina does
+static char illumina_bin(char c) {
+  static const int LOW[] = { 2, 10, 20, 25, 30, 35, 40 };
+  static const int TO[] = { 6, 15, 22, 27, 33, 37, 40 };
+  for (int i = 6; i >= 0; --i)
+    if (c - 33 >= LOW[i])
+      return 33 + TO[i];
+  return c;
+}
+
+BOOST_AUTO_TEST_CASE( binned_and_renamed_reads_match_plain_run ) {
+
+  for (int seed = 1; seed <= NUM_ROUNDS; ++seed) {
+    Round t(seed);
+
+    // -m samples on the old names, so renaming must not change what is kept
+    std::string m = " -m " + std::to_string(1 + seed % 3) + " -q ";
+    RunCounts ref = run_variant_counts(t.args(t.dir("ref.bam")) + m + t.dir("ref.qc") + " --rejected " + t.dir("ref_rej.bam"),
+				       t.dir("ref.log"));
+    RunCounts bin = run_variant_counts(t.args(t.dir("bin.bam")) + m + t.dir("bin.qc") + " --bin-qualities illumina", t.dir("bin.log"));
+    RunCounts ren = run_variant_counts(t.args(t.dir("ren.bam")) + m + t.dir("ren.qc") + " --rename-reads --rename-map " + t.dir("ren.tsv"),
+				       t.dir("ren.log"));
+    BOOST_REQUIRE(ref.total >= 0 && bin.total >= 0 && ren.total >= 0);
+
+    std::string qc = slurp(t.dir("ref.qc"));
+    BOOST_CHECK_MESSAGE(qc == slurp(t.dir("bin.qc")), "--bin-qualities stats (seed " << seed << ")");
+    BOOST_CHECK_MESSAGE(qc == slurp(t.dir("ren.qc")), "--rename-reads stats (seed " << seed << ")");
+    check_counts(ref, bin, true, "--bin-qualities", seed);
+    check_counts(ref, ren, true, "--rename-reads", seed);
+
+    // with -m, the failed reads wait with the sampled ones, so --rejected is sorted too
+    BOOST_CHECK_MESSAGE(sorted_once(read_records(t.dir("ref_rej.bam"))), "-m --rejected (seed " << seed << ") is not sorted");
+
+    // the plain run's reads, with their qualities binned
+    std::vector<std::string> ref_reads = read_records(t.dir("ref.bam")), binned;
+    for (const auto& r : ref_reads) {
+      std::vector<std::string> f;
+      std::stringstream ss(r);
+      for (std::string x; std::getline(ss, x, '\t'); )
+	f.push_back(x);
+      if (f.size() > 10 && f[10] != "*")
+	std::transform(f[10].begin(), f[10].end(), f[10].begin(), illumina_bin);
+      std::string line;
+      for (size_t i = 0; i < f.size(); ++i)
+	line += (i ? "\t" : "") + f[i];
+      binned.push_back(line);
+    }
+    check_same(binned, read_records(t.dir("bin.bam")), "--bin-qualities illumina", seed);
+
+    // the plain run's reads, each name swapped one to one for an 11-character id
+    std::vector<std::string> renamed = read_records(t.dir("ren.bam"));
+    BOOST_CHECK_MESSAGE(renamed.size() == ref_reads.size(), "--rename-reads (seed " << seed << "): " << renamed.size()
+			<< " reads, expected " << ref_reads.size());
+    std::map<std::string, std::string> to_new, to_old;
+    size_t bad = 0;
+    for (size_t i = 0; i < std::min(renamed.size(), ref_reads.size()); ++i) {
+      std::string q = sam_field(ref_reads[i], 0), id = sam_field(renamed[i], 0);
+      bool same_rest = renamed[i].substr(id.size()) == ref_reads[i].substr(q.size());
+      bool one_to_one = to_new.emplace(q, id).first->second == id && to_old.emplace(id, q).first->second == q;
+      bad += !same_rest || !one_to_one || id.size() != 11;
+    }
+    BOOST_CHECK_MESSAGE(bad == 0, "--rename-reads (seed " << seed << "): " << bad << " reads renamed wrongly");
+
+    // and the map gives back the old names
+    std::ifstream map(t.dir("ren.tsv"));
+    size_t unmapped = 0;
+    for (std::string id, q; map >> id >> q; )
+      unmapped += !to_old.count(id) || to_old[id] != q;
+    BOOST_CHECK_MESSAGE(unmapped == 0, "--rename-map (seed " << seed << "): " << unmapped << " lines don't match the output");
+  }
+}
+
+BOOST_AUTO_TEST_CASE( split_read_groups_match_plain_run ) {
+
+  for (int seed = 1; seed <= NUM_ROUNDS; ++seed) {
+    Round t(seed);
+
+    // the group of each kept read, from its RG tag in the plain run
+    BOOST_REQUIRE(run_variant(t.args(t.dir("ref.bam"))));
+    std::vector<std::string> ref = read_records(t.dir("ref.bam")), groups;
+    for (const auto& r : ref) {
+      size_t p = r.find("\tRG:Z:");
+      groups.push_back(p == std::string::npos ? "" : r.substr(p + 6, r.find('\t', p + 6) - p - 6));
+    }
+
+    // the read group is looked up before the tags that hold it are stripped
+    for (const std::string strip : { "", " -S", " -s RG" }) {
+      BOOST_REQUIRE(run_variant(t.args(t.dir("strip.bam")) + strip));
+      std::system(("rm -f " + t.dir("split.*")).c_str());
+      BOOST_REQUIRE(run_variant(t.bam + " -r " + t.rules + " --split-read-groups " + t.dir("split.") + strip));
+      std::vector<std::string> stripped = read_records(t.dir("strip.bam"));
+      BOOST_REQUIRE_EQUAL(stripped.size(), ref.size());
+
+      for (const char* rg : { "rgA", "rgB" }) {
+	std::vector<std::string> expected;
+	for (size_t i = 0; i < ref.size(); ++i)
+	  if (groups[i] == rg)
+	    expected.push_back(stripped[i]);
+	// a group with no kept reads has no file
+	std::string out = t.dir("split." + std::string(rg) + ".bam");
+	check_same(expected, file_size(out) < 0 ? std::vector<std::string>() : read_records(out),
+		   "--split-read-groups" + strip + " " + rg, seed);
+      }
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE( max_coverage_counts_aligned_blocks ) {
+
+  // 40 spliced reads over [1000, 3040) cover only their two 20-base blocks.
+  // 8 reads sit in the intron, and 8 more end just before the first block.
+  // Neither set is over -m 10, so both must be kept whole, while the spliced
+  // reads, at depth 40, are sampled down
+  TempDir dir;
+  std::mt19937 rng(1);
+  std::vector<TestRead> reads;
+  auto add = [&](char prefix, int i, int32_t pos, std::vector<uint32_t> cigar) {
+    TestRead x;
+    x.qname = qname(prefix, i);
+    x.tid = 0;
+    x.pos = pos;
+    x.mapq = 60;
+    x.cigar = cigar;
+    x.rg = "rgA";
+    random_bases(rng, x);
+    reads.push_back(x);
+  };
+  for (int i = 0; i < 40; ++i)
+    add('s', i, 1000, { bam_cigar_gen(20, BAM_CMATCH), bam_cigar_gen(2000, BAM_CREF_SKIP), bam_cigar_gen(20, BAM_CMATCH) });
+  for (int i = 0; i < 8; ++i) {
+    add('i', i, 2000, { bam_cigar_gen(40, BAM_CMATCH) });
+    add('e', i, 960, { bam_cigar_gen(40, BAM_CMATCH) });
+  }
+  write_bam(reads, dir("in.bam"), dir("header.sam"));
+
+  BOOST_REQUIRE(run_variant(dir("in.bam") + " -m 10 -b -o " + dir("out.bam")));
+  std::map<char, int> kept;
+  for (const auto& r : read_records(dir("out.bam")))
+    ++kept[r[0]];
+  BOOST_CHECK_MESSAGE(kept['i'] == 8, "-m 10: kept " << kept['i'] << " of 8 reads in the intron");
+  BOOST_CHECK_MESSAGE(kept['e'] == 8, "-m 10: kept " << kept['e'] << " of 8 reads ending before the spliced reads");
+  BOOST_CHECK_MESSAGE(kept['s'] < 40, "-m 10: kept all 40 spliced reads");
+}
+
+// golden/ holds a small SAM input and the reads that golden/rules.json
+// (MAPQ 30 and up) keeps from it in the baseline, over the whole file and
+// over -k chr1:2001-6000. Unlike the cases above, these don't move when the
+// plain run does
+static std::string golden(const std::string& name) {
+  const char* d = getenv("srcdir");
+  return std::string(d && *d ? d : ".") + "/golden/" + name;
+}
+
+BOOST_AUTO_TEST_CASE( plain_and_planned_runs_match_golden_output ) {
+
+  TempDir dir;
+  std::string bam = dir("in.bam");
+  {
+    htsFile* in = hts_open(golden("in.sam").c_str(), "r");
+    BOOST_REQUIRE_MESSAGE(in, "could not open " << golden("in.sam"));
+    bam_hdr_t* hdr = sam_hdr_read(in);
+    htsFile* out = hts_open(bam.c_str(), "wb");
+    BOOST_REQUIRE(hdr && out && sam_hdr_write(out, hdr) == 0);
+    bam1_t* b = bam_init1();
+    while (sam_read1(in, hdr, b) >= 0)
+      BOOST_REQUIRE(sam_write1(out, hdr, b) >= 0);
+    bam_destroy1(b);
+    bam_hdr_destroy(hdr);
+    hts_close(out);
+    hts_close(in);
+    BOOST_REQUIRE(sam_index_build(bam.c_str(), 0) == 0);
+  }
+
+  std::string args = bam + " -r " + golden("rules.json") + " -b -o ";
+  BOOST_REQUIRE(run_variant(args + dir("all.bam")));
+  check_same(read_records(golden("mapq.sam")), read_records(dir("all.bam")), "golden whole file", 0);
+
+  BOOST_REQUIRE(run_variant(args + dir("region.bam") + " -k chr1:2001-6000"));
+  check_same(read_records(golden("mapq_region.sam")), read_records(dir("region.bam")), "golden -k", 0);
+
+  // the same, with the planner off
+  BOOST_REQUIRE(run_variant(args + dir("region_m.bam") + " -k chr1:2001-6000 -m 1000"));
+  check_same(read_records(golden("mapq_region.sam")), read_records(dir("region_m.bam")), "golden -k -m", 0);
+}